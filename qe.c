@@ -37,33 +37,61 @@
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <fcntl.h>
-#include <sched.h>
+#include <pthread.h>
 #include <signal.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QE_SCAN_X86
+#endif
+
 enum edit_mode {
     MODE_NORMAL = 0,
     MODE_INSERT,
     MODE_SEARCH,
+    MODE_COMMAND,
 };
 
 static const char *edit_mode_string[] = {
     "NORMAL",
     "INSERT",
     "SEARCH",
+    "COMMAND",
 };
 
+// Whether a prompt is open on the status line.
+static inline int qe_prompt_open(enum edit_mode mode)
+{
+    return mode == MODE_SEARCH || mode == MODE_COMMAND;
+}
+
+// Maximum number of fields of a record given with -R.
+#define QE_RECORD_FIELDS 32
+
+// Maximum size of a record given with -R, so offsets a screen of records
+// apart cannot overflow.
+#define QE_RECORD_MAX ((int64_t) 1 << 40)
+
 static struct {
     // Filename of <file>. Points to argv.
     const char *filename;
@@ -77,28 +105,73 @@ static struct {
     // Whether view matches editor state.
     volatile sig_atomic_t dirty;
 
-    // dirty implies the following but the converse is not true. These flags
-    // are for more efficient partial redraws.
+    // Whether only the cursor has moved. dirty implies this but the converse
+    // is not true. Any other partial redraw is found by diffing against the
+    // last frame.
     int dirty_cursor;
-    int dirty_status;
 
     // Whether the file should be mapped in read-only mode. If read-only, then
     // insert mode is completely disabled.
     int read_only;
 
-    // Whether edits should be synced to the page instantly or batched until
-    // explicitly requested by the user.
+    // Whether edits are only synced when leaving insert mode, rather than
+    // shortly after the last edit.
     int batched_save;
 
     // Whether we are in wrapping mode (default: no wrap)
     int wrap;
 
+    // Hex digit of the byte under the cursor the next typed nibble replaces,
+    // 0 for the high digit and 1 for the low.
+    int hex_nibble;
+
+    // Whether the file is shown as a hex dump. Rows are a fixed number of
+    // bytes, so <page_offset> is a multiple of QE_HEX_ROW and <cursor_x> is
+    // the byte within the row.
+    int hex;
+
+    // Record size given with -R, or 0. If set the file is shown as one
+    // fixed-size record per row rather than one line per row, and
+    // <page_offset> is a multiple of it.
+    int64_t record;
+
+    // End of each field of a record given with -R, relative to the record
+    // start. Fields are shaded alternately.
+    int64_t record_fields[QE_RECORD_FIELDS];
+    int record_nfields;
+
+    // Whether to show the render time of the last frame in the status line.
+    int frame_stats;
+
+    // Whether to open the file at its end.
+    int tail;
+
+    // Whether data appended to the file by another process is shown as it
+    // arrives. Implies <tail>.
+    int follow;
+
+    // Whether the line index is kept in a sidecar file next to <file> and
+    // reused when it is reopened.
+    int sidecar;
+
+    // Hex pattern given with -x. Its matches are printed instead of opening
+    // the viewer.
+    const char *batch_hex;
+
     // Messages on bottom of screen.
-    char status_buffer[64];
+    char status_buffer[256];
+
+    // Set while the status line shows a message. Background progress leaves
+    // it in place until the next key.
+    int status_message;
 
     // Virtual memory-mapped pages of <file>.
     uint8_t *page;
 
+    // Bytes mapped at <page>. More than the size of <file> when following, so
+    // it can grow in place.
+    int64_t page_size;
+
     // Byte offset into <page>. Always on new-line boundary.
     //
     // TODO: Not always on new-line boundary if wrapping extends over an entire
@@ -122,11 +195,69 @@ static struct {
     // Current active edit mode.
     enum edit_mode mode;
 
-    // Buffer for search string.
+    // Count typed before a key in normal mode, or 0 if none.
+    int64_t count;
+
+    // Command being typed after ':'.
+    char command_buf[64];
+    size_t command_len;
+
+    // Buffer for search string being typed.
     char search_buf[64];
 
     // Length of current search term.
     size_t search_len;
+
+    // Whether the search being typed is backward ('?').
+    int search_reverse;
+
+    // Whether the search being typed is a regular expression. Toggled with
+    // Ctrl-R at the prompt and kept for later searches.
+    int search_regex;
+
+    // Whether the search being typed ignores ASCII case. Toggled with Ctrl-F
+    // at the prompt and kept for later searches.
+    int search_fold;
+
+    // Whether the search being typed is a sequence of hex bytes. Toggled with
+    // Ctrl-X at the prompt and kept for later searches. Takes precedence over
+    // the two above.
+    int search_hex;
+
+    // Last committed search term and direction, repeated by n/N.
+    char search_term[64];
+    size_t search_term_len;
+    int search_term_reverse;
+
+    // Compiled last committed term if it is a regular expression, else NULL.
+    struct qe_regex *search_term_regex;
+
+    // View and cursor when the search prompt was opened. The search being
+    // typed runs from here, and the view returns here if it is cancelled.
+    struct {
+        int64_t page_offset;
+        int64_t page_offset_x;
+        uint16_t cursor_x;
+        uint16_t cursor_y;
+        int64_t offset;
+    } search_origin;
+
+    // Compiled search being typed if it is a valid regular expression.
+    struct qe_regex *search_buf_regex;
+
+    // Result of the incremental search of the search being typed: the match
+    // offset, -1 if there is none, or QE_SEARCH_PENDING if it has not
+    // completed or was not run.
+    int64_t search_buf_match;
+
+    // Search running in the background, or NULL.
+    struct qe_search *search;
+
+    // Full line index, or NULL if it could not be built.
+    struct qe_lines *lines;
+
+    // Index of every match of the last committed term, or NULL.
+    struct qe_matches *matches;
 } editor;
 
 static struct {
@@ -134,9 +265,6 @@ static struct {
     int16_t width;
     int16_t height;
 
-    // Whether a terminal resize event occurred.
-    volatile sig_atomic_t resized;
-
     // Original terminal settings prior to program start.
     struct termios original_settings;
 
@@ -168,448 +296,6333 @@ static void fatal(const char *msg)
     exit(1);
 }
 
-// TODO: Print \x08 byte value and return character printed count
-// (don't exceed end).
-static void print_char(char c)
+// Output for a single frame.
+//
+// The whole frame is composed here and then flushed with a single write, so
+// drawing costs one syscall regardless of screen size or content. The buffer
+// is sized for the worst case on every resize so it never grows mid-frame.
+static struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    // Render time and size of the last flushed frame.
+    int64_t ns;
+    size_t bytes;
+} frame;
+
+static void qe_frame_reserve(size_t cap)
 {
-    if (isprint(c)) {
-        putchar(c);
-    } else {
-        printf("\x1b[2m");  // dim
-        putchar('@');
-        printf("\x1b[0m");  // reset color
+    if (cap <= frame.cap) {
+        return;
+    }
+
+    char *buf = realloc(frame.buf, cap);
+    if (buf == NULL) {
+        fatal("failed to allocate frame buffer");
     }
+
+    frame.buf = buf;
+    frame.cap = cap;
 }
 
-static int qe_draw_wrap(void)
+static void qe_frame_append(const void *s, size_t n)
 {
-    int64_t offset = editor.page_offset;
-    int y;
-    for (y = 0; y < terminal.height - 1; ++y) {
-        for (int x = 0; x < terminal.width - 1; ++x) {
-            const char c = editor.page[offset];
-            offset += 1;
+    if (frame.len + n > frame.cap) {
+        qe_frame_reserve(2 * (frame.len + n));
+    }
 
-            if (offset >= editor.file.st_size) {
-                goto file_end;
-            }
+    memcpy(frame.buf + frame.len, s, n);
+    frame.len += n;
+}
 
-            if (c == '\n') {
-                goto next_row;
-            } else {
-                print_char(c);
+#define qe_frame_puts(s) qe_frame_append((s), sizeof(s) - 1)
+
+__attribute__((format(printf, 1, 2)))
+static void qe_frame_printf(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(frame.buf + frame.len, frame.cap - frame.len, fmt, ap);
+    va_end(ap);
+
+    if (n < 0) {
+        return;
+    }
+
+    if ((size_t) n >= frame.cap - frame.len) {
+        qe_frame_reserve(2 * (frame.len + n + 1));
+
+        va_start(ap, fmt);
+        vsnprintf(frame.buf + frame.len, frame.cap - frame.len, fmt, ap);
+        va_end(ap);
+    }
+
+    frame.len += n;
+}
+
+// Write all of `s` to the terminal, retrying on short writes.
+static void qe_write(const char *s, size_t n)
+{
+    while (n != 0) {
+        ssize_t r = write(STDOUT_FILENO, s, n);
+        if (r == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
             }
+            return;
         }
 
-next_row:
-        printf("\x1b[E");
+        s += r;
+        n -= r;
     }
+}
 
-    return y;
+static void qe_frame_flush(void)
+{
+    qe_write(frame.buf, frame.len);
+    frame.bytes = frame.len;
+    frame.len = 0;
+}
 
-file_end:
-    printf("\x1b[E");
-    return y;
+static int64_t qe_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static int qe_draw_nowrap(void)
+// Maximum length of a pattern of byte sets.
+#define QE_PATTERN_MAX 64
+
+// Maximum number of byte ranges in a class a pattern is filtered on.
+#define QE_CLASS_RANGES 4
+
+enum class_kind {
+    // The single byte <lo[0]>.
+    CLASS_BYTE = 0,
+
+    // <lo[0]> and the byte differing from it only in 0x20, which is the ASCII
+    // case bit. Tested as (c | 0x20) == lo[0].
+    CLASS_FOLD,
+
+    // Bytes in [lo[i], lo[i] + span[i]] for each of the <n> ranges. Tested as
+    // (c - lo[i]) <= span[i] unsigned.
+    CLASS_RANGES,
+};
+
+// A set of bytes in a form the scanning kernels test 16-64 bytes at a time.
+struct qe_class {
+    uint8_t kind;
+    uint8_t n;
+    uint8_t lo[QE_CLASS_RANGES];
+    uint8_t span[QE_CLASS_RANGES];
+};
+
+// A fixed length string where each position matches a set of bytes, such as
+// a case-insensitive term or a regular expression made only of byte classes.
+//
+// It is scanned in place: candidates must match the classes of two positions,
+// <a> and <b>, picked as the least likely to occur in text, and are then
+// checked against the set of every position.
+struct qe_pattern {
+    uint64_t set[QE_PATTERN_MAX][4];
+    size_t len;
+
+    // Set if <a> and <b> have classes, else every position is checked.
+    int filter;
+    size_t a;
+    size_t b;
+    struct qe_class ca;
+    struct qe_class cb;
+
+    // Estimated frequency of bytes matching <ca>, see qe_byte_weight.
+    int weight;
+};
+
+static inline void qe_set_add(uint64_t *set, uint8_t c)
 {
-    int64_t offset = editor.page_offset;
-    int y;
-    for (y = 0; y < terminal.height - 1; ++y) {
-        // clip start of lines
-        if (offset + editor.page_offset_x >= editor.file.st_size) {
-            goto file_end;
+    set[c >> 6] |= 1ull << (c & 63);
+}
+
+static inline int qe_set_has(const uint64_t *set, uint8_t c)
+{
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+// Return whether the pattern matches at `p`.
+static inline int qe_pattern_at(const struct qe_pattern *t, const uint8_t *p)
+{
+    for (size_t i = 0; i < t->len; ++i) {
+        if (!qe_set_has(t->set[i], p[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Rough frequency of byte `c` in text, used to pick the pattern positions
+// least likely to match.
+static int qe_byte_weight(int c)
+{
+    if (c >= 'a' && c <= 'z') {
+        return strchr("etaoinshrdlu", c) ? 8 : strchr("jqxz", c) ? 2 : 5;
+    }
+    if (c == ' ') {
+        return 8;
+    }
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '\n' ||
+            c == '.' || c == ',' || c == '_' || c == '-' || c == '/') {
+        return 4;
+    }
+    return c >= 0x20 && c < 0x7f ? 2 : 1;
+}
+
+// Describe `set` as a class. Returns 0 if it has too many ranges.
+static int qe_class_init(struct qe_class *c, const uint64_t *set)
+{
+    memset(c, 0, sizeof(*c));
+    c->kind = CLASS_RANGES;
+
+    for (int i = 0; i < 256; ) {
+        if (!qe_set_has(set, i)) {
+            i += 1;
+            continue;
         }
-        uint8_t *beg = memchr(editor.page + offset, '\n', editor.page_offset_x);
-        if (beg) {
-            // new-line encountered so early break
-            goto next_row;
+
+        int j = i;
+        while (j < 255 && qe_set_has(set, j + 1)) {
+            j += 1;
         }
-        offset += editor.page_offset_x;
 
-        int x;
-        for (x = 0; x < terminal.width; ++x) {
-            const char c = editor.page[offset];
-            offset += 1;
+        if (c->n == QE_CLASS_RANGES) {
+            return 0;
+        }
+        c->lo[c->n] = i;
+        c->span[c->n] = j - i;
+        c->n += 1;
+        i = j + 1;
+    }
 
-            if (offset >= editor.file.st_size) {
-                goto file_end;
-            }
+    if (c->n == 1 && c->span[0] == 0) {
+        c->kind = CLASS_BYTE;
+    } else if (c->n == 2 && c->span[0] == 0 && c->span[1] == 0 && (c->lo[0] ^ c->lo[1]) == 0x20) {
+        c->kind = CLASS_FOLD;
+        c->lo[0] = c->lo[1];
+    }
+    return 1;
+}
 
-            if (c == '\n') {
-                goto next_row;
-            } else {
-                print_char(c);
+// Pick the positions of `t` to filter candidates on once its sets are filled
+// in: the one least likely to match, then the next least likely, as far from
+// it as possible.
+static void qe_pattern_prepare(struct qe_pattern *t)
+{
+    int weight[QE_PATTERN_MAX];
+    for (size_t i = 0; i < t->len; ++i) {
+        struct qe_class c;
+        weight[i] = INT_MAX;
+        if (qe_class_init(&c, t->set[i])) {
+            weight[i] = 0;
+            for (int k = 0; k < 256; ++k) {
+                weight[i] += qe_set_has(t->set[i], k) ? qe_byte_weight(k) : 0;
             }
         }
+    }
 
-        // Clip line endings (scan for next).
-        // This needs to be fast to handle files with very long single lines.
-        // So we prefer memchr vs. a simple loop.
-        uint8_t *end = memchr(editor.page + offset, '\n', editor.file.st_size - offset);
-        if (!end) {
-            goto file_end;
+    t->filter = 0;
+    t->a = t->b = 0;
+    for (size_t i = 1; i < t->len; ++i) {
+        if (weight[i] < weight[t->a]) {
+            t->a = i;
         }
+    }
+    if (t->len == 0 || weight[t->a] == INT_MAX) {
+        return;
+    }
 
-        offset = end - &editor.page[offset];
+    // positions further from <a> are less likely to match together with it
+    t->b = t->a;
+    for (size_t i = 0; i < t->len; ++i) {
+        if (i == t->a || weight[i] == INT_MAX) {
+            continue;
+        }
 
-    next_row:
-        printf("\x1b[E");
+        const size_t d = i > t->a ? i - t->a : t->a - i;
+        const size_t db = t->b > t->a ? t->b - t->a : t->a - t->b;
+        if (t->b == t->a || weight[i] < weight[t->b] || (weight[i] == weight[t->b] && d > db)) {
+            t->b = i;
+        }
     }
 
-    return y;
+    qe_class_init(&t->ca, t->set[t->a]);
+    qe_class_init(&t->cb, t->set[t->b]);
+    t->weight = weight[t->a];
+    t->filter = 1;
+}
 
-file_end:
-    printf("\x1b[E");
-    return y;
+// Maximum number of terms searched for at once, and of bytes in them all.
+#define QE_TERMS_MAX 32
+#define QE_TERMS_BYTES 128
+
+// Terms are found by the SIMD kernels if there are at most this many, else by
+// the automaton.
+#define QE_TERMS_TEDDY 8
+
+// A set of literal terms searched for at once, optionally ignoring ASCII case.
+//
+// A small set is found with Teddy: each of the first <prefix> bytes of every
+// candidate start is looked up by nibble in a table per byte position, giving
+// the terms which may have that nibble there. Candidates where every lookup
+// agrees on a term are then checked. A larger set, or a CPU without a byte
+// shuffle, runs an Aho-Corasick automaton at one table lookup per byte.
+struct qe_terms {
+    int n;
+    int fold;
+
+    // Term <k> is <len[k]> bytes at <bytes + off[k]>, lower case if <fold>.
+    uint8_t bytes[QE_TERMS_BYTES];
+    uint8_t off[QE_TERMS_MAX];
+    uint8_t len[QE_TERMS_MAX];
+    size_t shortest;
+    size_t longest;
+
+    // Teddy tables, one bit per term, or <prefix> is 0 if there are too many
+    // terms.
+    int prefix;
+    uint8_t lo[3][16];
+    uint8_t hi[3][16];
+
+    // Automaton over the terms, with <out> the terms ending at each state, and
+    // the same over the reversed terms to scan backward.
+    uint8_t next[QE_TERMS_BYTES + 1][256];
+    uint32_t out[QE_TERMS_BYTES + 1];
+    uint8_t rnext[QE_TERMS_BYTES + 1][256];
+    uint32_t rout[QE_TERMS_BYTES + 1];
+};
+
+static inline uint8_t qe_fold_byte(uint8_t c)
+{
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
 }
 
-static void qe_draw_cursor(void)
+// Return the first term matching at `p` within `avail` bytes, or -1.
+static inline int qe_terms_at(const struct qe_terms *t, const uint8_t *p, size_t avail)
 {
-    // move cursor to x,y
-    printf("\x1b[%d;%dH", editor.cursor_y + 1, editor.cursor_x + 1);
-    editor.dirty_cursor = 0;
+    for (int k = 0; k < t->n; ++k) {
+        const uint8_t *s = t->bytes + t->off[k];
+        size_t i = 0;
+        if (t->len[k] > avail) {
+            continue;
+        }
+        if (t->fold) {
+            while (i < t->len[k] && qe_fold_byte(p[i]) == s[i]) {
+                i += 1;
+            }
+        } else {
+            while (i < t->len[k] && p[i] == s[i]) {
+                i += 1;
+            }
+        }
+        if (i == t->len[k]) {
+            return k;
+        }
+    }
+    return -1;
 }
 
-static void qe_draw_status(void)
+// Build the automaton over the terms, or the reversed terms if `reverse`,
+// into `next` and `out`.
+static void qe_terms_automaton(const struct qe_terms *t, int reverse, uint8_t (*next)[256], uint32_t *out)
 {
-    printf("\x1b[2;7m");  // invert color, dim
+    // trie, where 0 is both the root and no edge yet
+    int states = 1;
+    memset(next, 0, (QE_TERMS_BYTES + 1) * sizeof(next[0]));
+    memset(out, 0, (QE_TERMS_BYTES + 1) * sizeof(out[0]));
+    for (int k = 0; k < t->n; ++k) {
+        int s = 0;
+        for (size_t i = 0; i < t->len[k]; ++i) {
+            const uint8_t c = t->bytes[t->off[k] + (reverse ? t->len[k] - 1 - i : i)];
+            if (next[s][c] == 0) {
+                next[s][c] = states++;
+            }
+            s = next[s][c];
+        }
+        out[s] |= 1u << k;
+    }
 
-    int at_end = 0;
-    for (int i = 0; i < terminal.width; ++i) {
-        if (editor.status_buffer[i] == 0) {
-            at_end = 1;
+    // Breadth first, each missing edge is taken from the longest proper
+    // suffix of the state, which is nearer the root so already complete.
+    uint8_t fail[QE_TERMS_BYTES + 1];
+    uint8_t queue[QE_TERMS_BYTES + 1];
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; ++c) {
+        if (next[0][c]) {
+            fail[next[0][c]] = 0;
+            queue[tail++] = next[0][c];
+        }
+    }
+    while (head < tail) {
+        const int s = queue[head++];
+        out[s] |= out[fail[s]];
+        for (int c = 0; c < 256; ++c) {
+            const int u = next[s][c];
+            if (u) {
+                fail[u] = next[fail[s]][c];
+                queue[tail++] = u;
+            } else {
+                next[s][c] = next[fail[s]][c];
+            }
         }
-        putchar(!at_end ? editor.status_buffer[i] : ' ');
     }
 
-    printf("\x1b[0m");  // reset color
-    editor.dirty_status = 0;
+    // terms are lower case, so upper case input steps the same way
+    for (int s = 0; t->fold && s < states; ++s) {
+        for (int c = 'a'; c <= 'z'; ++c) {
+            next[s][c - 0x20] = next[s][c];
+        }
+    }
 }
 
-// Draw entire editor content to terminal. No delta is computed so a complete
-// redraw is always performed. Only required when editor.dirty is true.
-static void qe_draw(void)
+// Fill in the tables of `t` once its terms are set.
+static void qe_terms_prepare(struct qe_terms *t)
 {
-    // hide cursor, clear screen, move cursor to 0,0
-    printf("\x1b[?25l\x1b[2J\x1b[H");
-
-    int y = editor.wrap ? qe_draw_wrap() : qe_draw_nowrap();
+    t->shortest = SIZE_MAX;
+    t->longest = 0;
+    for (int k = 0; k < t->n; ++k) {
+        t->shortest = t->len[k] < t->shortest ? t->len[k] : t->shortest;
+        t->longest = t->len[k] > t->longest ? t->len[k] : t->longest;
+    }
 
-    // end of file markers
-    for (; y < terminal.height - 1; ++y) {
-        printf("~\x1b[E");
+    t->prefix = 0;
+    memset(t->lo, 0, sizeof(t->lo));
+    memset(t->hi, 0, sizeof(t->hi));
+    if (t->n <= QE_TERMS_TEDDY) {
+        t->prefix = t->shortest < 3 ? t->shortest : 3;
+        for (int k = 0; k < t->n; ++k) {
+            for (int i = 0; i < t->prefix; ++i) {
+                const uint8_t c = t->bytes[t->off[k] + i];
+                t->lo[i][c & 15] |= 1u << k;
+                t->hi[i][c >> 4] |= 1u << k;
+                if (t->fold && c >= 'a' && c <= 'z') {
+                    t->hi[i][(c ^ 0x20) >> 4] |= 1u << k;
+                }
+            }
+        }
     }
 
-    qe_draw_status();
+    qe_terms_automaton(t, 0, t->next, t->out);
+    qe_terms_automaton(t, 1, t->rnext, t->rout);
+}
 
-    qe_draw_cursor();
+// Byte scanning kernels.
+//
+// Every scan for new-lines (window movement, cursor positioning, drawing and
+// the line index) goes through one of these. The implementation is picked once
+// at startup based on what the cpu supports.
+//
+// `nth` returns the `*n`th (1-based) occurrence of `c` scanning forward from
+// `p`, `rnth` the `*n`th scanning backward from `p + len`. If there are not
+// enough occurrences NULL is returned and `*n` is reduced by the number that
+// were seen, so a scan can be resumed over the following range.
+//
+// `mem` returns the first occurrence of the string `s` within `p[0..len)`
+// like memmem, and `rmem` the last, which glibc does not provide. `pmem` and
+// `rpmem` do the same for a pattern of byte sets.
+//
+// `tmem` returns the first start within `p[0..n)` of any of a set of terms,
+// and `rtmem` the last, where the term must end within `p[0..avail)`.
+static struct {
+    const char *name;
+    const uint8_t *(*nth)(const uint8_t *p, size_t len, uint8_t c, int64_t *n);
+    const uint8_t *(*rnth)(const uint8_t *p, size_t len, uint8_t c, int64_t *n);
+    int64_t (*count)(const uint8_t *p, size_t len, uint8_t c);
+    const uint8_t *(*mem)(const uint8_t *p, size_t len, const uint8_t *s, size_t n);
+    const uint8_t *(*rmem)(const uint8_t *p, size_t len, const uint8_t *s, size_t n);
+    const uint8_t *(*pmem)(const uint8_t *p, size_t len, const struct qe_pattern *t);
+    const uint8_t *(*rpmem)(const uint8_t *p, size_t len, const struct qe_pattern *t);
+    const uint8_t *(*tmem)(const uint8_t *p, size_t n, size_t avail, const struct qe_terms *t);
+    const uint8_t *(*rtmem)(const uint8_t *p, size_t n, size_t avail, const struct qe_terms *t);
+} scan;
+
+static const uint8_t *qe_scan_nth_generic(const uint8_t *p, size_t len, uint8_t c, int64_t *n)
+{
+    const uint8_t *end = p + len;
+    while (p < end) {
+        const uint8_t *q = memchr(p, c, end - p);
+        if (!q) {
+            break;
+        }
 
-    // show cursor
-    printf("\x1b[?25h");
+        if (--*n == 0) {
+            return q;
+        }
+        p = q + 1;
+    }
 
-    qe_draw_cursor();
+    return NULL;
+}
 
-    fflush(stdout);
+static const uint8_t *qe_scan_rnth_generic(const uint8_t *p, size_t len, uint8_t c, int64_t *n)
+{
+    while (len != 0) {
+        const uint8_t *q = memrchr(p, c, len);
+        if (!q) {
+            break;
+        }
 
-    editor.dirty = 0;
+        if (--*n == 0) {
+            return q;
+        }
+        len = q - p;
+    }
+
+    return NULL;
 }
 
-static void qe_terminal_init(void)
+static int64_t qe_scan_count_generic(const uint8_t *p, size_t len, uint8_t c)
 {
-    struct termios raw_settings;
+    int64_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        n += p[i] == c;
+    }
 
-    if (!isatty(STDIN_FILENO)) {
-        fatal("not a tty");
+    return n;
+}
+
+static const uint8_t *qe_scan_mem_generic(const uint8_t *p, size_t len, const uint8_t *s, size_t n)
+{
+    if (n == 0 || n > len) {
+        return NULL;
     }
 
-    if (tcgetattr(STDIN_FILENO, &terminal.original_settings) < 0) {
-        fatal("could not get terminal settings");
+    // TODO: GNU specific
+    return memmem(p, len, s, n);
+}
+
+static const uint8_t *qe_scan_rmem_generic(const uint8_t *p, size_t len, const uint8_t *s, size_t n)
+{
+    if (n == 0 || n > len) {
+        return NULL;
     }
 
-    raw_settings = terminal.original_settings;
-    raw_settings.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-    raw_settings.c_oflag &= ~OPOST;
-    raw_settings.c_cflag |= CS8;
-    raw_settings.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-    raw_settings.c_cc[VMIN] = 0;
-    raw_settings.c_cc[VTIME] = 1;
+    // candidate starts are [p, p + len - n]
+    len = len - n + 1;
+    while (len != 0) {
+        const uint8_t *q = memrchr(p, s[0], len);
+        if (!q) {
+            break;
+        }
 
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw_settings) < 0) {
-        fatal("failed to set new terminal settings");
+        if (!memcmp(q + 1, s + 1, n - 1)) {
+            return q;
+        }
+        len = q - p;
     }
 
-    // save screen content (for restore)
-    printf("\x1b[?47h");
-    terminal.raw_mode = 1;
-    atexit(qe_terminal_cleanup);
+    return NULL;
 }
 
-static void qe_winsize(void)
+static const uint8_t *qe_scan_pmem_generic(const uint8_t *p, size_t len, const struct qe_pattern *t)
 {
-    struct winsize w;
+    if (t->len == 0 || t->len > len) {
+        return NULL;
+    }
 
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0) {
-        fatal("failed to get terminal size");
+    const uint8_t *end = p + len - t->len + 1;
+    for (; p < end; ++p) {
+        if (qe_set_has(t->set[t->a], p[t->a]) && qe_pattern_at(t, p)) {
+            return p;
+        }
     }
 
-    terminal.width = w.ws_col;
-    terminal.height = w.ws_row;
-    terminal.resized = 0;
+    return NULL;
 }
 
-// Called if the window is resized.
-//
-// When the `was_resized` value is set the blocking read will return and give
-// the program the chance to update the screen again.
-//
-// TODO: Does not catch the case of stacking <-> tiling in i3.
-static void qe_winsize_sighandler(int signo)
+static const uint8_t *qe_scan_rpmem_generic(const uint8_t *p, size_t len, const struct qe_pattern *t)
 {
-    (void) signo;
-    terminal.resized = 1;
-    editor.dirty = 1;
+    if (t->len == 0 || t->len > len) {
+        return NULL;
+    }
+
+    for (const uint8_t *q = p + len - t->len + 1; q-- != p; ) {
+        if (qe_set_has(t->set[t->a], q[t->a]) && qe_pattern_at(t, q)) {
+            return q;
+        }
+    }
+
+    return NULL;
 }
 
-static void qe_winsize_sighandler_init(void)
+// A match ending at each byte starts up to <longest> bytes before it, so the
+// scan can stop once no later match can start before the earliest seen.
+static const uint8_t *qe_scan_tmem_generic(const uint8_t *p, size_t n, size_t avail, const struct qe_terms *t)
 {
-    struct sigaction sa;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sa.sa_handler = qe_winsize_sighandler;
-
-    if (sigaction(SIGWINCH, &sa, NULL) == -1) {
-        fatal("failed to setup sigwinch handler");
+    size_t best = SIZE_MAX;
+    int s = 0;
+    for (size_t j = 0; j < avail; ++j) {
+        s = t->next[s][p[j]];
+        for (uint32_t m = t->out[s]; m; m &= m - 1) {
+            const size_t start = j + 1 - t->len[__builtin_ctz(m)];
+            best = start < best ? start : best;
+        }
+        if (best != SIZE_MAX && j + 2 > best + t->longest) {
+            break;
+        }
     }
+
+    return best < n ? p + best : NULL;
 }
 
-static void qe_init(void)
+// The reversed terms complete where a term starts, so the first found scanning
+// backward is the last.
+static const uint8_t *qe_scan_rtmem_generic(const uint8_t *p, size_t n, size_t avail, const struct qe_terms *t)
 {
-    memset(&editor, 0, sizeof(editor));
-    editor.filename = NULL;
-    editor.dirty = 1;
-    editor.fd = -1;
-    editor.page = NULL;
+    int s = 0;
+    for (size_t j = avail; j-- > 0; ) {
+        s = t->rnext[s][p[j]];
+        if (t->rout[s] && j < n) {
+            return p + j;
+        }
+    }
 
-    memset(&terminal, 0, sizeof(terminal));
+    return NULL;
 }
 
-static void qe_init_terminal()
+#ifdef QE_SCAN_X86
+
+// Each implementation only differs in how it builds a 64-bit match mask for a
+// 64-byte block, so the scanning loops are shared through this macro.
+//
+// A block with fewer matches than still required is skipped with a single
+// popcount, so sparse new-lines cost one compare per 16-64 bytes.
+#define QE_SCAN_DEFINE(isa, tgt, mask)                                          \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_nth_##isa(const uint8_t *p, size_t len,      \
+                                            uint8_t c, int64_t *n)              \
+    {                                                                           \
+        const uint8_t *end = p + len;                                           \
+        for (; end - p >= 64; p += 64) {                                        \
+            uint64_t m = mask(p, c);                                            \
+            const int64_t k = __builtin_popcountll(m);                          \
+            if (k < *n) {                                                       \
+                *n -= k;                                                        \
+                continue;                                                       \
+            }                                                                   \
+            while (--*n) {                                                      \
+                m &= m - 1;                                                     \
+            }                                                                   \
+            return p + __builtin_ctzll(m);                                      \
+        }                                                                       \
+        return qe_scan_nth_generic(p, end - p, c, n);                           \
+    }                                                                           \
+                                                                                \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_rnth_##isa(const uint8_t *p, size_t len,     \
+                                             uint8_t c, int64_t *n)             \
+    {                                                                           \
+        const uint8_t *end = p + len;                                           \
+        for (; end - p >= 64; end -= 64) {                                      \
+            uint64_t m = mask(end - 64, c);                                     \
+            const int64_t k = __builtin_popcountll(m);                          \
+            if (k < *n) {                                                       \
+                *n -= k;                                                        \
+                continue;                                                       \
+            }                                                                   \
+            while (--*n) {                                                      \
+                m &= ~(1ull << (63 - __builtin_clzll(m)));                      \
+            }                                                                   \
+            return end - 64 + (63 - __builtin_clzll(m));                        \
+        }                                                                       \
+        return qe_scan_rnth_generic(p, end - p, c, n);                          \
+    }                                                                           \
+                                                                                \
+    __attribute__((target(tgt)))                                                \
+    static int64_t qe_scan_count_##isa(const uint8_t *p, size_t len, uint8_t c) \
+    {                                                                           \
+        const uint8_t *end = p + len;                                           \
+        int64_t n = 0;                                                          \
+        for (; end - p >= 64; p += 64) {                                        \
+            n += __builtin_popcountll(mask(p, c));                              \
+        }                                                                       \
+        return n + qe_scan_count_generic(p, end - p, c);                        \
+    }                                                                           \
+                                                                                \
+    /* Candidates must match both the first and last byte of the string, */    \
+    /* which filters out almost everything before the full compare. */         \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_mem_##isa(const uint8_t *p, size_t len,      \
+                                            const uint8_t *s, size_t n)         \
+    {                                                                           \
+        if (n < 2 || n > len) {                                                 \
+            int64_t k = 1;                                                      \
+            return n == 1 ? qe_scan_nth_##isa(p, len, s[0], &k)                 \
+                          : qe_scan_mem_generic(p, len, s, n);                  \
+        }                                                                       \
+        const uint8_t *end = p + len - n + 1;                                   \
+        for (; end - p >= 64; p += 64) {                                        \
+            uint64_t m = mask(p, s[0]) & mask(p + n - 1, s[n - 1]);             \
+            while (m) {                                                         \
+                const int i = __builtin_ctzll(m);                               \
+                if (!memcmp(p + i + 1, s + 1, n - 2)) {                         \
+                    return p + i;                                               \
+                }                                                               \
+                m &= m - 1;                                                     \
+            }                                                                   \
+        }                                                                       \
+        return qe_scan_mem_generic(p, end - p + n - 1, s, n);                   \
+    }                                                                           \
+                                                                                \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_rmem_##isa(const uint8_t *p, size_t len,     \
+                                             const uint8_t *s, size_t n)        \
+    {                                                                           \
+        if (n < 2 || n > len) {                                                 \
+            return qe_scan_rmem_generic(p, len, s, n);                          \
+        }                                                                       \
+        const uint8_t *end = p + len - n + 1;                                   \
+        for (; end - p >= 64; end -= 64) {                                      \
+            const uint8_t *b = end - 64;                                        \
+            uint64_t m = mask(b, s[0]) & mask(b + n - 1, s[n - 1]);             \
+            while (m) {                                                         \
+                const int i = 63 - __builtin_clzll(m);                          \
+                if (!memcmp(b + i + 1, s + 1, n - 2)) {                         \
+                    return b + i;                                               \
+                }                                                               \
+                m &= ~(1ull << i);                                              \
+            }                                                                   \
+        }                                                                       \
+        return qe_scan_rmem_generic(p, end - p + n - 1, s, n);                  \
+    }
+
+__attribute__((target("sse2")))
+static inline uint64_t qe_mask64_sse2(const uint8_t *p, uint8_t c)
 {
-    qe_terminal_init();
-    qe_winsize();
-    qe_winsize_sighandler_init();
+    const __m128i v = _mm_set1_epi8(c);
+    const uint64_t m0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), v));
+    const uint64_t m1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), v));
+    const uint64_t m2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 32)), v));
+    const uint64_t m3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 48)), v));
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
 }
 
-// glibc defines this macro, but other libc's such as musl do not.
-#undef CTRL
-#define CTRL(k) ((k & 0x1f))
+__attribute__((target("avx2")))
+static inline uint64_t qe_mask64_avx2(const uint8_t *p, uint8_t c)
+{
+    const __m256i v = _mm256_set1_epi8(c);
+    const uint64_t m0 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), v));
+    const uint64_t m1 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 32)), v));
+    return m0 | m1 << 32;
+}
 
-enum keycode {
-    TAB = 9,
-    ENTER = 13,
-    ESC = 27,
-    BACKSPACE = 127,
+__attribute__((target("avx512f,avx512bw")))
+static inline uint64_t qe_mask64_avx512(const uint8_t *p, uint8_t c)
+{
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *) p), _mm512_set1_epi8(c));
+}
 
-    HOME = 0x1ff,
-    END,
-    DEL,
-    PGUP,
-    PGDN,
-    ARROW_UP,
-    ARROW_DOWN,
-    ARROW_RIGHT,
-    ARROW_LEFT
-};
+QE_SCAN_DEFINE(sse2, "sse2", qe_mask64_sse2)
+QE_SCAN_DEFINE(avx2, "avx2,popcnt", qe_mask64_avx2)
+QE_SCAN_DEFINE(avx512, "avx512f,avx512bw,popcnt", qe_mask64_avx512)
+
+// Pattern scans test the classes of the two filter positions for a 64-byte
+// block of candidate starts at once, like the first and last byte of `mem`.
+#define QE_SCAN_PATTERN_DEFINE(isa, tgt, cmask)                                 \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_pmem_##isa(const uint8_t *p, size_t len,     \
+                                             const struct qe_pattern *t)        \
+    {                                                                           \
+        if (!t->filter || t->len > len) {                                       \
+            return qe_scan_pmem_generic(p, len, t);                             \
+        }                                                                       \
+        const uint8_t *end = p + len - t->len + 1;                              \
+        for (; end - p >= 64; p += 64) {                                        \
+            uint64_t m = cmask(p + t->a, &t->ca) & cmask(p + t->b, &t->cb);     \
+            while (m) {                                                         \
+                const int i = __builtin_ctzll(m);                               \
+                if (qe_pattern_at(t, p + i)) {                                  \
+                    return p + i;                                               \
+                }                                                               \
+                m &= m - 1;                                                     \
+            }                                                                   \
+        }                                                                       \
+        return qe_scan_pmem_generic(p, end - p + t->len - 1, t);                \
+    }                                                                           \
+                                                                                \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_rpmem_##isa(const uint8_t *p, size_t len,    \
+                                              const struct qe_pattern *t)       \
+    {                                                                           \
+        if (!t->filter || t->len > len) {                                       \
+            return qe_scan_rpmem_generic(p, len, t);                            \
+        }                                                                       \
+        const uint8_t *end = p + len - t->len + 1;                              \
+        for (; end - p >= 64; end -= 64) {                                      \
+            const uint8_t *b = end - 64;                                        \
+            uint64_t m = cmask(b + t->a, &t->ca) & cmask(b + t->b, &t->cb);     \
+            while (m) {                                                         \
+                const int i = 63 - __builtin_clzll(m);                          \
+                if (qe_pattern_at(t, b + i)) {                                  \
+                    return b + i;                                               \
+                }                                                               \
+                m &= ~(1ull << i);                                              \
+            }                                                                   \
+        }                                                                       \
+        return qe_scan_rpmem_generic(p, end - p + t->len - 1, t);               \
+    }
 
-static void qe_args(int argc, char **argv)
+__attribute__((target("sse2")))
+static inline __m128i qe_class16_sse2(__m128i x, const struct qe_class *c)
 {
-    const char *help =
-        "usage: qe [options] filename\n"
-        "\n"
-        "   -ro   read-only\n"
-        "   -s    no automatic save/sync (unimplemented)\n"
-        "   -w    wrap\n"
-        "   -h    print help"
-        ;
+    switch (c->kind) {
+        case CLASS_BYTE:
+            return _mm_cmpeq_epi8(x, _mm_set1_epi8(c->lo[0]));
 
-    for (int i = 1; i < argc; ++i) {
-        const char *a = argv[i];
-        if (a[0] == '-') {
-            if (!strcmp(a, "-ro")) {
-                editor.read_only = 1;
-            } else if (!strcmp(a, "-s")) {
-                editor.batched_save = 1;
-            } else if (!strcmp(a, "-w")) {
-                editor.wrap = 1;
-            } else if (!strcmp(a, "-h")) {
-                fatal(help);
-            } else {
-                fatal("unknown argument");
+        case CLASS_FOLD:
+            return _mm_cmpeq_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8(c->lo[0]));
+
+        default:
+        {
+            // no unsigned compare, so d <= span is min(d, span) == d
+            __m128i r = _mm_setzero_si128();
+            for (int i = 0; i < c->n; ++i) {
+                const __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(c->lo[i]));
+                r = _mm_or_si128(r, _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(c->span[i])), d));
             }
-        } else {
-            if (editor.filename != NULL) {
-                fatal("only one filename is allowed");
+            return r;
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static inline uint64_t qe_cmask64_sse2(const uint8_t *p, const struct qe_class *c)
+{
+    uint64_t m = 0;
+    for (int i = 0; i < 4; ++i) {
+        const __m128i x = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+        m |= (uint64_t) (uint16_t) _mm_movemask_epi8(qe_class16_sse2(x, c)) << (16 * i);
+    }
+    return m;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i qe_class32_avx2(__m256i x, const struct qe_class *c)
+{
+    switch (c->kind) {
+        case CLASS_BYTE:
+            return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c->lo[0]));
+
+        case CLASS_FOLD:
+            return _mm256_cmpeq_epi8(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), _mm256_set1_epi8(c->lo[0]));
+
+        default:
+        {
+            __m256i r = _mm256_setzero_si256();
+            for (int i = 0; i < c->n; ++i) {
+                const __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(c->lo[i]));
+                r = _mm256_or_si256(r, _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(c->span[i])), d));
             }
+            return r;
+        }
+    }
+}
 
-            editor.filename = a;
+__attribute__((target("avx2")))
+static inline uint64_t qe_cmask64_avx2(const uint8_t *p, const struct qe_class *c)
+{
+    const __m256i x0 = _mm256_loadu_si256((const __m256i *) p);
+    const __m256i x1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+    const uint64_t m0 = (uint32_t) _mm256_movemask_epi8(qe_class32_avx2(x0, c));
+    const uint64_t m1 = (uint32_t) _mm256_movemask_epi8(qe_class32_avx2(x1, c));
+    return m0 | m1 << 32;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline uint64_t qe_cmask64_avx512(const uint8_t *p, const struct qe_class *c)
+{
+    const __m512i x = _mm512_loadu_si512((const void *) p);
+    switch (c->kind) {
+        case CLASS_BYTE:
+            return _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8(c->lo[0]));
+
+        case CLASS_FOLD:
+            return _mm512_cmpeq_epi8_mask(_mm512_or_si512(x, _mm512_set1_epi8(0x20)),
+                                          _mm512_set1_epi8(c->lo[0]));
+
+        default:
+        {
+            uint64_t m = 0;
+            for (int i = 0; i < c->n; ++i) {
+                const __m512i d = _mm512_sub_epi8(x, _mm512_set1_epi8(c->lo[i]));
+                m |= _mm512_cmple_epu8_mask(d, _mm512_set1_epi8(c->span[i]));
+            }
+            return m;
         }
     }
+}
 
-    if (editor.filename == NULL) {
-        fatal(help);
+QE_SCAN_PATTERN_DEFINE(sse2, "sse2", qe_cmask64_sse2)
+QE_SCAN_PATTERN_DEFINE(avx2, "avx2", qe_cmask64_avx2)
+QE_SCAN_PATTERN_DEFINE(avx512, "avx512f,avx512bw", qe_cmask64_avx512)
+
+// Term scans test a 64-byte block of candidate starts at once, reading up to
+// <prefix> - 1 bytes past it, and leave what is left at either end to the
+// automaton.
+#define QE_SCAN_TERMS_DEFINE(isa, tgt, tmask)                                   \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_tmem_##isa(const uint8_t *p, size_t n,       \
+                                             size_t avail,                      \
+                                             const struct qe_terms *t)          \
+    {                                                                           \
+        if (!t->prefix) {                                                       \
+            return qe_scan_tmem_generic(p, n, avail, t);                        \
+        }                                                                       \
+        size_t i = 0;                                                           \
+        for (; i + 64 <= n && i + 64 + t->prefix - 1 <= avail; i += 64) {       \
+            for (uint64_t m = tmask(p + i, t); m; m &= m - 1) {                 \
+                const size_t j = i + __builtin_ctzll(m);                        \
+                if (qe_terms_at(t, p + j, avail - j) != -1) {                   \
+                    return p + j;                                               \
+                }                                                               \
+            }                                                                   \
+        }                                                                       \
+        return i < n ? qe_scan_tmem_generic(p + i, n - i, avail - i, t) : NULL; \
+    }                                                                           \
+                                                                                \
+    __attribute__((target(tgt)))                                                \
+    static const uint8_t *qe_scan_rtmem_##isa(const uint8_t *p, size_t n,      \
+                                              size_t avail,                     \
+                                              const struct qe_terms *t)         \
+    {                                                                           \
+        if (!t->prefix || avail < n + t->prefix - 1) {                          \
+            return qe_scan_rtmem_generic(p, n, avail, t);                       \
+        }                                                                       \
+        size_t e = n;                                                           \
+        for (; e >= 64; e -= 64) {                                              \
+            const size_t b = e - 64;                                            \
+            for (uint64_t m = tmask(p + b, t); m; ) {                           \
+                const size_t j = b + 63 - __builtin_clzll(m);                   \
+                if (qe_terms_at(t, p + j, avail - j) != -1) {                   \
+                    return p + j;                                               \
+                }                                                               \
+                m &= ~(1ull << (j - b));                                        \
+            }                                                                   \
+        }                                                                       \
+        const size_t tail = e + t->longest - 1;                                 \
+        return e ? qe_scan_rtmem_generic(p, e, tail < avail ? tail : avail, t) : NULL; \
+    }
+
+__attribute__((target("avx2")))
+static inline uint64_t qe_tmask64_avx2(const uint8_t *p, const struct qe_terms *t)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i r0 = _mm256_set1_epi8(-1);
+    __m256i r1 = r0;
+    for (int i = 0; i < t->prefix; ++i) {
+        const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->lo[i]));
+        const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->hi[i]));
+        const __m256i x0 = _mm256_loadu_si256((const __m256i *) (p + i));
+        const __m256i x1 = _mm256_loadu_si256((const __m256i *) (p + i + 32));
+        r0 = _mm256_and_si256(r0, _mm256_and_si256(
+                 _mm256_shuffle_epi8(lo, _mm256_and_si256(x0, nibble)),
+                 _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(x0, 4), nibble))));
+        r1 = _mm256_and_si256(r1, _mm256_and_si256(
+                 _mm256_shuffle_epi8(lo, _mm256_and_si256(x1, nibble)),
+                 _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(x1, 4), nibble))));
     }
+
+    const __m256i zero = _mm256_setzero_si256();
+    const uint64_t m0 = (uint32_t) ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(r0, zero));
+    const uint64_t m1 = (uint32_t) ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(r1, zero));
+    return m0 | m1 << 32;
 }
 
-static void qe_open(void)
+__attribute__((target("avx512f,avx512bw")))
+static inline uint64_t qe_tmask64_avx512(const uint8_t *p, const struct qe_terms *t)
 {
-    int open_flags = editor.read_only ? O_RDONLY : O_RDWR;
-    editor.fd = open(editor.filename, open_flags);
-    if (editor.fd == -1) {
-        fatal("failed to open file");
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    __m512i r = _mm512_set1_epi8(-1);
+    for (int i = 0; i < t->prefix; ++i) {
+        const __m512i lo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) t->lo[i]));
+        const __m512i hi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) t->hi[i]));
+        const __m512i x = _mm512_loadu_si512((const void *) (p + i));
+        r = _mm512_and_si512(r, _mm512_and_si512(
+                _mm512_shuffle_epi8(lo, _mm512_and_si512(x, nibble)),
+                _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi16(x, 4), nibble))));
     }
+    return _mm512_test_epi8_mask(r, r);
+}
 
-    if (fstat(editor.fd, &editor.file) < 0) {
-        fatal("failed to fstat file");
+// SSE2 has no byte shuffle, so uses the automaton.
+QE_SCAN_TERMS_DEFINE(avx2, "avx2", qe_tmask64_avx2)
+QE_SCAN_TERMS_DEFINE(avx512, "avx512f,avx512bw", qe_tmask64_avx512)
+
+#endif
+
+static void qe_scan_init(void)
+{
+    scan.name = "generic";
+    scan.nth = qe_scan_nth_generic;
+    scan.rnth = qe_scan_rnth_generic;
+    scan.count = qe_scan_count_generic;
+    scan.mem = qe_scan_mem_generic;
+    scan.rmem = qe_scan_rmem_generic;
+    scan.pmem = qe_scan_pmem_generic;
+    scan.rpmem = qe_scan_rpmem_generic;
+    scan.tmem = qe_scan_tmem_generic;
+    scan.rtmem = qe_scan_rtmem_generic;
+
+#ifdef QE_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        scan.name = "avx512";
+        scan.nth = qe_scan_nth_avx512;
+        scan.rnth = qe_scan_rnth_avx512;
+        scan.count = qe_scan_count_avx512;
+        scan.mem = qe_scan_mem_avx512;
+        scan.rmem = qe_scan_rmem_avx512;
+        scan.pmem = qe_scan_pmem_avx512;
+        scan.rpmem = qe_scan_rpmem_avx512;
+        scan.tmem = qe_scan_tmem_avx512;
+        scan.rtmem = qe_scan_rtmem_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        scan.name = "avx2";
+        scan.nth = qe_scan_nth_avx2;
+        scan.rnth = qe_scan_rnth_avx2;
+        scan.count = qe_scan_count_avx2;
+        scan.mem = qe_scan_mem_avx2;
+        scan.rmem = qe_scan_rmem_avx2;
+        scan.pmem = qe_scan_pmem_avx2;
+        scan.rpmem = qe_scan_rpmem_avx2;
+        scan.tmem = qe_scan_tmem_avx2;
+        scan.rtmem = qe_scan_rtmem_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan.name = "sse2";
+        scan.nth = qe_scan_nth_sse2;
+        scan.rnth = qe_scan_rnth_sse2;
+        scan.count = qe_scan_count_sse2;
+        scan.mem = qe_scan_mem_sse2;
+        scan.rmem = qe_scan_rmem_sse2;
+        scan.pmem = qe_scan_pmem_sse2;
+        scan.rpmem = qe_scan_rpmem_sse2;
     }
+#endif
+}
 
-    int mmap_flags = editor.read_only ? PROT_READ : PROT_WRITE | PROT_READ;
-    editor.page = mmap(NULL, editor.file.st_size, mmap_flags, MAP_SHARED, editor.fd, 0);
-    if (editor.page == MAP_FAILED) {
-        fatal("failed to mmap file");
+// Return the first occurrence of `c` in `p[0..len)` or NULL.
+static inline const uint8_t *qe_memchr(const uint8_t *p, uint8_t c, size_t len)
+{
+    int64_t n = 1;
+    return scan.nth(p, len, c, &n);
+}
+
+#define qe_printable(c) ((c) >= 0x20 && (c) < 0x7f)
+
+// Display attribute of a screen cell.
+enum cell_attr {
+    ATTR_NONE = 0,
+    ATTR_DIM,
+    ATTR_STATUS,
+    ATTR_MATCH,
+    ATTR_FIELD,
+
+    // Matches of each term of a multi-term search, cycling through
+    // QE_TERM_COLORS colors.
+    ATTR_TERM,
+};
+
+#define QE_TERM_COLORS 6
+
+// Escape sequence selecting each attribute. Each resets any prior attribute.
+static const char *cell_attr_sgr[] = {
+    "\x1b[0m",
+    "\x1b[0;2m",
+    "\x1b[0;2;7m",
+    "\x1b[0;7m",
+    "\x1b[0;36m",
+    "\x1b[0;30;43m",
+    "\x1b[0;30;46m",
+    "\x1b[0;30;45m",
+    "\x1b[0;30;42m",
+    "\x1b[0;30;41m",
+    "\x1b[0;30;44m",
+};
+
+struct cell {
+    uint8_t ch;
+    uint8_t attr;
+};
+
+// Screen content as a grid of cells.
+//
+// Each frame is composed into <cells> and then diffed against <shadow>, which
+// holds what the terminal currently shows. Only changed spans are written,
+// so typing a character in insert mode sends a handful of bytes instead of
+// the whole screen.
+static struct {
+    struct cell *cells;
+    struct cell *shadow;
+
+    // Byte offset of the start of each row in <cells> and <shadow>, or -1 if
+    // the row shows no file content. Used to detect scrolling.
+    int64_t *rows;
+    int64_t *shadow_rows;
+
+    // View parameters <shadow_rows> was drawn with. Rows can only be reused
+    // by scrolling if these are unchanged.
+    int shadow_wrap;
+    int shadow_hex;
+    int64_t shadow_x;
+
+    int width;
+    int height;
+
+    // Whether <shadow> matches the terminal. Cleared on resize or when a
+    // refresh is requested, forcing a full repaint.
+    int valid;
+} grid;
+
+// Unchanged cells between two changed spans on a row are rewritten rather
+// than jumped over if there are at most this many, since a cursor movement
+// escape costs about as much.
+#define QE_GRID_GAP 8
+
+static void qe_grid_resize(int width, int height)
+{
+    const size_t n = (size_t) width * height;
+    struct cell *cells = realloc(grid.cells, n * sizeof(struct cell));
+    struct cell *shadow = realloc(grid.shadow, n * sizeof(struct cell));
+    int64_t *rows = realloc(grid.rows, height * sizeof(int64_t));
+    int64_t *shadow_rows = realloc(grid.shadow_rows, height * sizeof(int64_t));
+    if (cells == NULL || shadow == NULL || rows == NULL || shadow_rows == NULL) {
+        fatal("failed to allocate screen grid");
     }
+
+    grid.cells = cells;
+    grid.shadow = shadow;
+    grid.rows = rows;
+    grid.shadow_rows = shadow_rows;
+    grid.width = width;
+    grid.height = height;
+    grid.valid = 0;
 }
 
-// Update the status buffer with the current file status.
+static inline struct cell *qe_grid_row(int y)
+{
+    return grid.cells + (size_t) y * grid.width;
+}
+
+static void qe_grid_clear(void)
+{
+    const struct cell blank = { ' ', ATTR_NONE };
+    for (size_t i = 0; i < (size_t) grid.width * grid.height; ++i) {
+        grid.cells[i] = blank;
+    }
+
+    for (int y = 0; y < grid.height; ++y) {
+        grid.rows[y] = -1;
+    }
+}
+
+// Draw the bytes p[0..n) to row y starting at column x. Non-printable bytes are
+// drawn as a dim '@'. Returns the column following the last cell drawn.
 //
-// This keeps track of the filename and current file position. It must be called
-// if page_offset is modified.
+// TODO: Print \x08 byte value.
+static int qe_draw_text(int y, int x, const uint8_t *p, int64_t n)
+{
+    struct cell *row = qe_grid_row(y);
+    if (n > grid.width - x) {
+        n = grid.width - x;
+    }
+
+    for (int64_t i = 0; i < n; ++i, ++x) {
+        if (qe_printable(p[i])) {
+            row[x].ch = p[i];
+            row[x].attr = ATTR_NONE;
+        } else {
+            row[x].ch = '@';
+            row[x].attr = ATTR_DIM;
+        }
+    }
+
+    return x;
+}
+
+// If the composed frame is the last frame shifted by fewer rows than the
+// viewport, scroll the existing terminal content with a scroll region instead
+// of repainting it. The shadow grid is shifted to match so the diff only
+// writes the newly exposed rows.
 //
-// TODO: Handle page_offset_x movement.
-static void qe_update_status_buffer(void)
+// The status line is the last row and is kept outside the scroll region.
+static void qe_grid_scroll(void)
 {
-    int64_t through = 0;
-    if (editor.page_offset != 0) {
-        through = 100ll * editor.page_offset / editor.file.st_size;
+    const int h = grid.height - 1;
+    if (!grid.valid || grid.shadow_wrap != editor.wrap ||
+            grid.shadow_hex != editor.hex || grid.shadow_x != editor.page_offset_x) {
+        return;
     }
 
-    snprintf(editor.status_buffer, sizeof(editor.status_buffer),
-             "%s: %3"PRId64"%% - %.32s (+%"PRId64") (%"PRId64"/%"PRId64")",
-             edit_mode_string[editor.mode],
-             through, editor.filename, editor.page_offset_x,
-             editor.page_offset + editor.page_offset_x, editor.file.st_size);
+    // positive k moves the content up (forward in the file)
+    int k = 0;
+    for (int i = 1; i < h; ++i) {
+        if (grid.rows[0] != -1 && grid.shadow_rows[i] == grid.rows[0]) {
+            k = i;
+            break;
+        }
+        if (grid.shadow_rows[0] != -1 && grid.rows[i] == grid.shadow_rows[0]) {
+            k = -i;
+            break;
+        }
+    }
+
+    if (k == 0) {
+        return;
+    }
+
+    const int ak = k > 0 ? k : -k;
+    const size_t row_size = grid.width * sizeof(struct cell);
+    const struct cell blank = { ' ', ATTR_NONE };
+
+    // Scrolled in rows take the current background, so reset first. Setting
+    // the region homes the cursor, which the diff repositions anyway.
+    qe_frame_printf("\x1b[0m\x1b[1;%dr\x1b[%d%c\x1b[r", h, ak, k > 0 ? 'S' : 'T');
+
+    struct cell *moved = k > 0 ? grid.shadow : grid.shadow + (size_t) ak * grid.width;
+    struct cell *kept = k > 0 ? grid.shadow + (size_t) ak * grid.width : grid.shadow;
+    memmove(moved, kept, (h - ak) * row_size);
+
+    struct cell *exposed = k > 0 ? grid.shadow + (size_t) (h - ak) * grid.width : grid.shadow;
+    for (size_t i = 0; i < (size_t) ak * grid.width; ++i) {
+        exposed[i] = blank;
+    }
 }
 
-// Scan from the current page offset past `n` newlines and set the new page
-// offset. A negative value indicates reverse traversal.
+// Write the difference between the composed grid and the shadow grid to the
+// frame, then make the shadow match.
 //
-// Stops if the edge of a file is reached.
-static void qe_move_window_y(int32_t n)
+// Attributes are only emitted where they change, so a run of binary content
+// is a single dim span.
+static void qe_grid_emit(void)
 {
-    const int step = n > 0 ? 1 : -1;
-    const int32_t an = n > 0 ? n : -n;
+    if (!grid.valid) {
+        // After clearing, the terminal is known to be blank.
+        qe_frame_puts("\x1b[0m\x1b[2J");
+        const struct cell blank = { ' ', ATTR_NONE };
+        for (size_t i = 0; i < (size_t) grid.width * grid.height; ++i) {
+            grid.shadow[i] = blank;
+        }
+        grid.valid = 1;
+    }
 
-    int32_t i = 0;
-    while (1) {
-        if (editor.page_offset < 0) {
-            editor.page_offset = 0;
-            qe_update_status_buffer();
-            return;
+    int attr = -1;
+    int cx = -1, cy = -1;
+
+    for (int y = 0; y < grid.height; ++y) {
+        const struct cell *cur = qe_grid_row(y);
+        struct cell *old = grid.shadow + (size_t) y * grid.width;
+
+        int x = 0;
+        while (x < grid.width) {
+            if (cur[x].ch == old[x].ch && cur[x].attr == old[x].attr) {
+                x += 1;
+                continue;
+            }
+
+            // extend the span over short runs of unchanged cells
+            int last = x;
+            for (int j = x + 1; j < grid.width && j - last <= QE_GRID_GAP; ++j) {
+                if (cur[j].ch != old[j].ch || cur[j].attr != old[j].attr) {
+                    last = j;
+                }
+            }
+
+            if (cy != y || cx != x) {
+                qe_frame_printf("\x1b[%d;%dH", y + 1, x + 1);
+            }
+
+            for (; x <= last; ++x) {
+                if (cur[x].attr != attr) {
+                    attr = cur[x].attr;
+                    qe_frame_append(cell_attr_sgr[attr], strlen(cell_attr_sgr[attr]));
+                }
+                qe_frame_append(&cur[x].ch, 1);
+            }
+
+            // the cursor is left in a pending wrap state at the last column
+            cx = x < grid.width ? x : -1;
+            cy = y;
         }
-        if (editor.page_offset >= editor.file.st_size) {
-            editor.page_offset = editor.file.st_size - 1;
-            qe_update_status_buffer();
-            return;
+
+        memcpy(old, cur, grid.width * sizeof(struct cell));
+    }
+
+    memcpy(grid.shadow_rows, grid.rows, grid.height * sizeof(int64_t));
+    grid.shadow_wrap = editor.wrap;
+    grid.shadow_hex = editor.hex;
+    grid.shadow_x = editor.page_offset_x;
+
+    if (attr > ATTR_NONE) {
+        qe_frame_puts("\x1b[0m");  // reset color
+    }
+}
+
+static void qe_highlight_begin(void);
+static void qe_draw_matches(int y, int64_t from, int64_t to);
+
+static int qe_draw_wrap(void)
+{
+    int64_t offset = editor.page_offset;
+    int y;
+    for (y = 0; y < terminal.height - 1; ++y) {
+        if (offset >= editor.file.st_size) {
+            break;
         }
 
-        if (editor.page[editor.page_offset] == '\n') {
-            if (++i > an) {
-                editor.page_offset += step;
+        int64_t n = editor.file.st_size - offset;
+        if (n > terminal.width - 1) {
+            n = terminal.width - 1;
+        }
 
-                // if moving backwards, we are at the end of the line, move
-                // to the start (or start of file).
-                if (step < 0) {
-                    while (editor.page_offset != 0 && editor.page[editor.page_offset] != '\n') {
-                        editor.page_offset -= 1;
-                    }
+        const uint8_t *nl = qe_memchr(editor.page + offset, '\n', n);
+        const int64_t end = nl ? nl - editor.page : offset + n;
+        grid.rows[y] = offset;
+        qe_draw_text(y, 0, editor.page + offset, end - offset);
+        qe_draw_matches(y, offset, end);
+        offset = end;
 
-                    if (editor.page_offset != 0) {
-                        editor.page_offset += 1;
-                    }
+        // skip the new-line ending this row, including when the line exactly
+        // filled the row
+        if (offset < editor.file.st_size && editor.page[offset] == '\n') {
+            offset += 1;
+        }
+    }
+
+    return y;
+}
+
+static int qe_draw_nowrap(void)
+{
+    int64_t offset = editor.page_offset;
+    int y;
+    for (y = 0; y < terminal.height - 1; ++y) {
+        if (offset >= editor.file.st_size) {
+            break;
+        }
+
+        // Find the line ending. This needs to be fast to handle files with
+        // very long single lines.
+        const uint8_t *nl = qe_memchr(editor.page + offset, '\n', editor.file.st_size - offset);
+        const int64_t end = nl ? nl - editor.page : editor.file.st_size;
+
+        grid.rows[y] = offset;
+
+        // clip start and end of lines
+        const int64_t x = offset + editor.page_offset_x;
+        if (x < end) {
+            const int64_t n = end - x < terminal.width ? end - x : terminal.width;
+            qe_draw_text(y, 0, editor.page + x, n);
+            qe_draw_matches(y, x, x + n);
+        }
+
+        offset = end + 1;
+    }
+
+    return y;
+}
+
+// Bytes shown on each row of the hex view.
+#define QE_HEX_ROW 16
+
+// The two hex digits of every byte value. Rows of the hex view are encoded
+// with a lookup per byte rather than formatted.
+static char hex_table[256][2];
+
+static void qe_hex_table_init(void)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 256; ++i) {
+        hex_table[i][0] = digits[i >> 4];
+        hex_table[i][1] = digits[i & 15];
+    }
+}
+
+// Number of hex digits in the offset column, enough for the last offset in
+// the file.
+static int qe_hex_digits(void)
+{
+    int digits = 8;
+    while (digits < 16 && ((uint64_t) editor.file.st_size - 1) >> (4 * digits) != 0) {
+        digits += 1;
+    }
+    return digits;
+}
+
+// Column of the hex digits of byte `i` of a row. The row is split in two
+// halves by an extra space.
+static inline int qe_hex_column(int digits, int i)
+{
+    return digits + 2 + 3 * i + (i >= QE_HEX_ROW / 2);
+}
+
+// Column of byte `i` of a row in the ASCII column.
+static inline int qe_hex_ascii_column(int digits, int i)
+{
+    return qe_hex_column(digits, QE_HEX_ROW) + 2 + i;
+}
+
+// Bytes in each row of the view if rows are fixed-size, or 0 if rows are
+// lines.
+static inline int64_t qe_row_size(void)
+{
+    return editor.hex ? QE_HEX_ROW : editor.record;
+}
+
+// Shade the alternate fields of the record bytes [col, col + n) drawn from
+// the first column of row `y`. Non-printable bytes stay dim.
+static void qe_draw_fields(int y, int64_t col, int64_t n)
+{
+    struct cell *row = qe_grid_row(y);
+    int64_t start = 0;
+    for (int f = 0; f < editor.record_nfields + 1 && start < col + n; ++f) {
+        const int64_t end = f < editor.record_nfields ? editor.record_fields[f] : editor.record;
+        if (f % 2 == 1) {
+            for (int64_t c = start > col ? start : col; c < end && c < col + n; ++c) {
+                if (row[c - col].attr == ATTR_NONE) {
+                    row[c - col].attr = ATTR_FIELD;
                 }
+            }
+        }
+        start = end;
+    }
+}
 
-                break;
+// Draw the view as one record per row, clipped like lines in the unwrapped
+// view. Row y always starts at <page_offset> + y * <record>, so nothing
+// outside the view is read.
+static int qe_draw_records(void)
+{
+    int64_t offset = editor.page_offset;
+    int y;
+    for (y = 0; y < terminal.height - 1; ++y, offset += editor.record) {
+        if (offset >= editor.file.st_size) {
+            break;
+        }
+
+        const int64_t end = editor.file.st_size - offset < editor.record ?
+                            editor.file.st_size : offset + editor.record;
+
+        grid.rows[y] = offset;
+
+        // clip start and end of records
+        const int64_t x = offset + editor.page_offset_x;
+        if (x < end) {
+            const int64_t n = end - x < terminal.width ? end - x : terminal.width;
+            qe_draw_text(y, 0, editor.page + x, n);
+            qe_draw_fields(y, editor.page_offset_x, n);
+            qe_draw_matches(y, x, x + n);
+        }
+    }
+
+    return y;
+}
+
+// Draw the view as a hex dump: the offset, the bytes in hex and the bytes as
+// ASCII with non-printable bytes as a dim '.'.
+//
+// Row y always shows the bytes from <page_offset> + y * QE_HEX_ROW, so no
+// part of the file outside the view is read.
+static int qe_draw_hex(void)
+{
+    const int digits = qe_hex_digits();
+    const int ascii = qe_hex_ascii_column(digits, 0);
+
+    int64_t offset = editor.page_offset;
+    int y;
+    for (y = 0; y < terminal.height - 1; ++y, offset += QE_HEX_ROW) {
+        if (offset >= editor.file.st_size) {
+            break;
+        }
+
+        int n = QE_HEX_ROW;
+        if (editor.file.st_size - offset < n) {
+            n = editor.file.st_size - offset;
+        }
+
+        const uint8_t *p = editor.page + offset;
+        uint8_t line[16 + 2 + 3 * QE_HEX_ROW + 1 + 2 + QE_HEX_ROW + 1];
+        memset(line, ' ', sizeof(line));
+
+        uint64_t v = offset;
+        for (int i = digits - 1; i >= 0; --i, v >>= 4) {
+            line[i] = hex_table[v & 15][1];
+        }
+
+        for (int i = 0; i < n; ++i) {
+            const int x = qe_hex_column(digits, i);
+            line[x] = hex_table[p[i]][0];
+            line[x + 1] = hex_table[p[i]][1];
+            line[ascii + i] = qe_printable(p[i]) ? p[i] : '.';
+        }
+
+        line[ascii - 1] = '|';
+        line[ascii + n] = '|';
+
+        grid.rows[y] = offset;
+        qe_draw_text(y, 0, line, ascii + n + 1);
+
+        struct cell *row = qe_grid_row(y);
+        for (int i = 0; i < n && ascii + i < grid.width; ++i) {
+            if (!qe_printable(p[i])) {
+                row[ascii + i].attr = ATTR_DIM;
             }
         }
-
-        editor.page_offset += step;
+
+        qe_draw_matches(y, offset, offset + n);
+    }
+
+    return y;
+}
+
+static void qe_draw_cursor(void)
+{
+    int x = editor.cursor_x;
+    if (editor.hex) {
+        x = qe_hex_column(qe_hex_digits(), editor.cursor_x) + editor.hex_nibble;
+    }
+
+    // move cursor to x,y
+    qe_frame_printf("\x1b[%d;%dH", editor.cursor_y + 1, x + 1);
+    editor.dirty_cursor = 0;
+}
+
+static void qe_draw_status(void)
+{
+    const int y = terminal.height - 1;
+    struct cell *row = qe_grid_row(y);
+
+    size_t n = strnlen(editor.status_buffer, sizeof(editor.status_buffer));
+    qe_draw_text(y, 0, (const uint8_t *) editor.status_buffer, n);
+
+    if (editor.frame_stats) {
+        char stats[48];
+        int sn = snprintf(stats, sizeof(stats), " %"PRId64"us %zuB ",
+                          frame.ns / 1000, frame.bytes);
+        if (sn > 0 && sn <= terminal.width) {
+            qe_draw_text(y, terminal.width - sn, (const uint8_t *) stats, sn);
+        }
+    }
+
+    // invert color, dim
+    for (int x = 0; x < terminal.width; ++x) {
+        row[x].attr = ATTR_STATUS;
+    }
+}
+
+// Draw editor content to the terminal. Only required when editor.dirty is
+// true.
+//
+// The frame is composed into the screen grid, and only the cells that differ
+// from the last frame are written, with a single syscall.
+static void qe_draw(void)
+{
+    const int64_t start = qe_now_ns();
+
+    qe_grid_clear();
+    qe_highlight_begin();
+
+    int y;
+    if (editor.hex) {
+        y = qe_draw_hex();
+    } else if (editor.record) {
+        y = qe_draw_records();
+    } else {
+        y = editor.wrap ? qe_draw_wrap() : qe_draw_nowrap();
+    }
+
+    // end of file markers
+    for (; y < terminal.height - 1; ++y) {
+        qe_grid_row(y)[0].ch = '~';
+    }
+
+    qe_draw_status();
+
+    // hide cursor while updating
+    qe_frame_puts("\x1b[?25l");
+
+    qe_grid_scroll();
+    qe_grid_emit();
+
+    qe_draw_cursor();
+
+    // show cursor
+    qe_frame_puts("\x1b[?25h");
+
+    qe_frame_flush();
+
+    frame.ns = qe_now_ns() - start;
+    editor.dirty = 0;
+}
+
+static void qe_terminal_init(void)
+{
+    struct termios raw_settings;
+
+    if (!isatty(STDIN_FILENO)) {
+        fatal("not a tty");
+    }
+
+    if (tcgetattr(STDIN_FILENO, &terminal.original_settings) < 0) {
+        fatal("could not get terminal settings");
+    }
+
+    raw_settings = terminal.original_settings;
+    raw_settings.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw_settings.c_oflag &= ~OPOST;
+    raw_settings.c_cflag |= CS8;
+    raw_settings.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    // Reads never block, input is only read once the event loop reports it
+    // is available.
+    raw_settings.c_cc[VMIN] = 0;
+    raw_settings.c_cc[VTIME] = 0;
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw_settings) < 0) {
+        fatal("failed to set new terminal settings");
+    }
+
+    // save screen content (for restore)
+    qe_write("\x1b[?47h", 6);
+    terminal.raw_mode = 1;
+    atexit(qe_terminal_cleanup);
+}
+
+static void qe_winsize(void)
+{
+    struct winsize w;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1 || w.ws_col == 0) {
+        fatal("failed to get terminal size");
+    }
+
+    terminal.width = w.ws_col;
+    terminal.height = w.ws_row;
+
+    // Worst case is alternating printable and non-printable bytes, which is
+    // a dim span for every second cell.
+    qe_frame_reserve((size_t) (terminal.width + 8) * terminal.height * 8 + 256);
+    qe_grid_resize(terminal.width, terminal.height);
+}
+
+// Maximum number of file descriptors watched by the event loop.
+#define QE_LOOP_SOURCES 8
+
+// Maximum number of pending deferred calls.
+#define QE_LOOP_TIMERS 8
+
+// A file descriptor watched by the event loop and the handler run on the main
+// thread when it becomes readable.
+struct qe_source {
+    int fd;
+    void (*fn)(void);
+};
+
+// A deferred call, run on the main thread once <deadline> has passed.
+struct qe_timer {
+    int64_t deadline;
+    void (*fn)(void);
+};
+
+// Main event loop.
+//
+// The main thread blocks in epoll_wait until there is input, a resize, a
+// deferred call is due or a background job wakes it, so an idle editor uses
+// no cpu at all.
+static struct {
+    int epoll_fd;
+
+    // SIGWINCH is blocked and read from here rather than handled
+    // asynchronously.
+    int signal_fd;
+
+    // Armed for the earliest deadline in <timers>.
+    int timer_fd;
+
+    // Written by background threads to wake the main loop.
+    int wake_fd;
+
+    struct qe_source sources[QE_LOOP_SOURCES];
+    int nsources;
+
+    struct qe_timer timers[QE_LOOP_TIMERS];
+} loop;
+
+// Watch `fd` for input, running `fn` on the main thread when it is readable.
+static void qe_loop_add(int fd, void (*fn)(void))
+{
+    if (loop.nsources == QE_LOOP_SOURCES) {
+        fatal("too many event sources");
+    }
+
+    struct qe_source *src = &loop.sources[loop.nsources++];
+    src->fd = fd;
+    src->fn = fn;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        fatal("failed to add event source");
+    }
+}
+
+static void qe_loop_arm(void)
+{
+    int64_t deadline = 0;
+    for (int i = 0; i < QE_LOOP_TIMERS; ++i) {
+        if (loop.timers[i].fn && (deadline == 0 || loop.timers[i].deadline < deadline)) {
+            deadline = loop.timers[i].deadline;
+        }
+    }
+
+    // A zero value disarms the timer. Deadlines are always in the future
+    // relative to the clock epoch so never zero themselves.
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000;
+    its.it_value.tv_nsec = deadline % 1000000000;
+    timerfd_settime(loop.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Run `fn` on the main thread after `ms` milliseconds. Deferring a function
+// which is already pending moves its deadline.
+static void qe_loop_defer(void (*fn)(void), int64_t ms)
+{
+    struct qe_timer *slot = NULL;
+    for (int i = 0; i < QE_LOOP_TIMERS; ++i) {
+        if (loop.timers[i].fn == fn) {
+            slot = &loop.timers[i];
+            break;
+        }
+        if (!slot && !loop.timers[i].fn) {
+            slot = &loop.timers[i];
+        }
+    }
+
+    if (slot == NULL) {
+        fatal("too many deferred calls");
+    }
+
+    slot->fn = fn;
+    slot->deadline = qe_now_ns() + ms * 1000000;
+    qe_loop_arm();
+}
+
+// Wake the main loop. Safe to call from any thread.
+static void qe_loop_wake(void)
+{
+    uint64_t one = 1;
+    if (write(loop.wake_fd, &one, sizeof(one)) == -1) {
+        // counter is saturated, the loop will wake anyway
+    }
+}
+
+static void qe_loop_timer_ready(void)
+{
+    uint64_t expirations;
+    if (read(loop.timer_fd, &expirations, sizeof(expirations)) == -1) {
+        // spurious wakeup, deadlines are checked below regardless
+    }
+
+    const int64_t now = qe_now_ns();
+    for (int i = 0; i < QE_LOOP_TIMERS; ++i) {
+        void (*fn)(void) = loop.timers[i].fn;
+        if (fn && loop.timers[i].deadline <= now) {
+            // cleared first so the call may defer itself again
+            loop.timers[i].fn = NULL;
+            fn();
+        }
+    }
+
+    qe_loop_arm();
+}
+
+// Called if the window is resized.
+//
+// TODO: Does not catch the case of stacking <-> tiling in i3.
+static void qe_loop_signal_ready(void)
+{
+    struct signalfd_siginfo si;
+    while (read(loop.signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGWINCH) {
+            qe_winsize();
+            editor.dirty = 1;
+        }
+    }
+}
+
+static void qe_loop_wake_ready(void);
+
+// Create the event loop.
+//
+// This must run before any thread is started so that every thread inherits
+// the blocked signal mask, otherwise SIGWINCH could be delivered to (and
+// ignored by) a background thread.
+static void qe_loop_init(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        fatal("failed to block signals");
+    }
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    loop.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop.epoll_fd == -1 || loop.signal_fd == -1 || loop.timer_fd == -1 || loop.wake_fd == -1) {
+        fatal("failed to create event loop");
+    }
+
+    qe_loop_add(loop.signal_fd, qe_loop_signal_ready);
+    qe_loop_add(loop.timer_fd, qe_loop_timer_ready);
+    qe_loop_add(loop.wake_fd, qe_loop_wake_ready);
+}
+
+// Block until at least one event source is ready and run its handlers.
+static void qe_loop_wait(void)
+{
+    struct epoll_event events[QE_LOOP_SOURCES];
+
+    int n = epoll_wait(loop.epoll_fd, events, QE_LOOP_SOURCES, -1);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+
+        fatal("failed to wait for events");
+    }
+
+    for (int i = 0; i < n; ++i) {
+        const struct qe_source *src = events[i].data.ptr;
+        src->fn();
+    }
+}
+
+static void qe_init(void)
+{
+    memset(&editor, 0, sizeof(editor));
+    editor.filename = NULL;
+    editor.dirty = 1;
+    editor.fd = -1;
+    editor.page = NULL;
+
+    memset(&terminal, 0, sizeof(terminal));
+
+    qe_hex_table_init();
+}
+
+static void qe_init_terminal()
+{
+    qe_terminal_init();
+    qe_winsize();
+}
+
+// glibc defines this macro, but other libc's such as musl do not.
+#undef CTRL
+#define CTRL(k) ((k & 0x1f))
+
+enum keycode {
+    TAB = 9,
+    ENTER = 13,
+    ESC = 27,
+    BACKSPACE = 127,
+
+    HOME = 0x1ff,
+    END,
+    DEL,
+    PGUP,
+    PGDN,
+    ARROW_UP,
+    ARROW_DOWN,
+    ARROW_RIGHT,
+    ARROW_LEFT
+};
+
+// Parse a -R record layout: the record size, optionally followed by a colon
+// and the comma separated sizes of its leading fields.
+static void qe_args_record(const char *a)
+{
+    char *end;
+    errno = 0;
+    editor.record = strtoll(a, &end, 10);
+    if (end == a || errno == ERANGE || editor.record <= 0 || (*end != 0 && *end != ':')) {
+        fatal("invalid record size");
+    }
+    if (editor.record > QE_RECORD_MAX) {
+        fatal("record size too large");
+    }
+
+    int64_t field = 0;
+    while (*end != 0) {
+        a = end + 1;
+        errno = 0;
+        const int64_t size = strtoll(a, &end, 10);
+        if (end == a || errno == ERANGE || size <= 0 || (*end != 0 && *end != ',')) {
+            fatal("invalid record field size");
+        }
+        if (editor.record_nfields == QE_RECORD_FIELDS) {
+            fatal("too many record fields");
+        }
+
+        if (size > editor.record - field) {
+            fatal("record fields exceed the record size");
+        }
+        field += size;
+        editor.record_fields[editor.record_nfields++] = field;
+    }
+}
+
+static void qe_args(int argc, char **argv)
+{
+    const char *help =
+        "usage: qe [options] filename\n"
+        "\n"
+        "   -ro   read-only\n"
+        "   -s    sync edits only when leaving insert mode\n"
+        "   -w    wrap\n"
+        "   -t    open at the end of the file\n"
+        "   -f    follow data appended to the file, implies -t\n"
+        "   -p    show frame render time and size\n"
+        "   -i    keep the line index in FILE.qei and reuse it when reopened\n"
+        "   -x    print the offset of each match of a hex pattern and exit\n"
+        "   -R    show fixed-size records, -R SIZE or -R SIZE:FIELD,FIELD,...\n"
+        "   -h    print help"
+        ;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        if (a[0] == '-') {
+            if (!strcmp(a, "-ro")) {
+                editor.read_only = 1;
+            } else if (!strcmp(a, "-s")) {
+                editor.batched_save = 1;
+            } else if (!strcmp(a, "-w")) {
+                editor.wrap = 1;
+            } else if (!strcmp(a, "-t")) {
+                editor.tail = 1;
+            } else if (!strcmp(a, "-f")) {
+                editor.follow = 1;
+                editor.tail = 1;
+            } else if (!strcmp(a, "-p")) {
+                editor.frame_stats = 1;
+            } else if (!strcmp(a, "-i")) {
+                editor.sidecar = 1;
+            } else if (!strcmp(a, "-x")) {
+                if (i + 1 == argc) {
+                    fatal("-x requires a hex pattern");
+                }
+                editor.batch_hex = argv[++i];
+                editor.read_only = 1;
+            } else if (!strcmp(a, "-R")) {
+                if (i + 1 == argc) {
+                    fatal("-R requires a record size");
+                }
+                qe_args_record(argv[++i]);
+            } else if (!strcmp(a, "-h")) {
+                fatal(help);
+            } else {
+                fatal("unknown argument");
+            }
+        } else {
+            if (editor.filename != NULL) {
+                fatal("only one filename is allowed");
+            }
+
+            editor.filename = a;
+        }
+    }
+
+    if (editor.filename == NULL) {
+        fatal(help);
+    }
+}
+
+// Address space mapped past the end of a followed file, which is how far it
+// can grow while open.
+#define QE_FOLLOW_RESERVE ((int64_t) 1 << (sizeof(void *) == 8 ? 40 : 28))
+
+static void qe_open(void)
+{
+    int open_flags = editor.read_only ? O_RDONLY : O_RDWR;
+    editor.fd = open(editor.filename, open_flags);
+    if (editor.fd == -1) {
+        fatal("failed to open file");
+    }
+
+    if (fstat(editor.fd, &editor.file) < 0) {
+        fatal("failed to fstat file");
+    }
+
+    int mmap_flags = editor.read_only ? PROT_READ : PROT_WRITE | PROT_READ;
+    editor.page_size = editor.file.st_size;
+    if (editor.follow) {
+        // pages past the end of the file become readable as it grows
+        editor.page_size += QE_FOLLOW_RESERVE;
+        editor.page = mmap(NULL, editor.page_size, mmap_flags, MAP_SHARED, editor.fd, 0);
+        if (editor.page != MAP_FAILED) {
+            return;
+        }
+        editor.page_size = editor.file.st_size;
+    }
+
+    // an empty file cannot be mapped, and -x has nothing to read in it
+    if (editor.page_size == 0 && editor.batch_hex) {
+        return;
+    }
+
+    editor.page = mmap(NULL, editor.page_size, mmap_flags, MAP_SHARED, editor.fd, 0);
+    if (editor.page == MAP_FAILED) {
+        fatal("failed to mmap file");
+    }
+}
+
+// Return the size of the file. Background jobs call this while a followed
+// file grows on the main thread.
+static inline int64_t qe_file_size(void)
+{
+    return __atomic_load_n(&editor.file.st_size, __ATOMIC_ACQUIRE);
+}
+
+// Return the offset of the start of the line containing `offset`.
+static int64_t qe_line_start(int64_t offset)
+{
+    int64_t n = 1;
+    const uint8_t *p = scan.rnth(editor.page, offset, '\n', &n);
+    return p ? p - editor.page + 1 : 0;
+}
+
+// Return the offset of the start of the line `n` lines after the line starting
+// at `offset`. Stops at the start of the last line in the file.
+static int64_t qe_line_forward(int64_t offset, int64_t n)
+{
+    if (n == 0) {
+        return offset;
+    }
+
+    const uint8_t *p = scan.nth(editor.page + offset, editor.file.st_size - offset, '\n', &n);
+    if (!p || p - editor.page + 1 >= editor.file.st_size) {
+        // A trailing new-line does not start another line.
+        return qe_line_start(editor.file.st_size - 1);
+    }
+
+    return p - editor.page + 1;
+}
+
+// Return the offset of the start of the line `n` lines before the line
+// containing `offset`. Stops at the start of the file.
+static int64_t qe_line_backward(int64_t offset, int64_t n)
+{
+    // the first new-line found ends the previous line
+    n += 1;
+    const uint8_t *p = scan.rnth(editor.page, offset, '\n', &n);
+    return p ? p - editor.page + 1 : 0;
+}
+
+// Return the offset following the new-line ending the line containing
+// `offset`, or the file size if it is the last line.
+static int64_t qe_line_next(int64_t offset)
+{
+    const int64_t size = qe_file_size();
+    const uint8_t *p = qe_memchr(editor.page + offset, '\n', size - offset);
+    return p ? p - editor.page + 1 : size;
+}
+
+// Count the new-lines in the byte range [begin, end).
+static int64_t qe_line_count(int64_t begin, int64_t end)
+{
+    return scan.count(editor.page + begin, end - begin, '\n');
+}
+
+// Number of lines between two checkpoints of the line index.
+//
+// Any line lookup falls back to scanning at most this many lines from the
+// nearest checkpoint.
+#define QE_LINE_CHECKPOINT 1024
+
+// Amount of file the index builder scans between progress updates.
+#define QE_LINE_INDEX_BLOCK (4 << 20)
+
+// Sparse index of line start offsets, built in the background after the file
+// is opened.
+//
+// Entry k of <offsets> is the byte offset of the start of line
+// k * QE_LINE_CHECKPOINT. The builder thread only ever appends, publishing
+// new entries by a release store of <count>, so the main thread can use any
+// prefix of the index without locking. An edit that splits or joins lines
+// stops the builder and cuts the index back before resuming it.
+static struct {
+    // Checkpoint offsets. Reserved up-front for the worst case (every byte a
+    // new-line) with MAP_NORESERVE so the array never moves while it is being
+    // read. Only the pages actually written are backed by memory.
+    int64_t *offsets;
+
+    // Number of entries reserved in <offsets>.
+    int64_t capacity;
+
+    // Number of valid entries in <offsets>. Always >= 1 once started.
+    int64_t count;
+
+    // Bytes of the file scanned so far. Every new-line before this offset has
+    // been accounted for.
+    int64_t scanned;
+
+    // New-lines between the last checkpoint and <scanned>. Only valid while
+    // the builder is not running.
+    int64_t pending;
+
+    // Total number of lines in the file. Only valid once <complete> is set.
+    int64_t lines;
+    int complete;
+
+    // Set to stop the builder early.
+    int stop;
+
+    pthread_t thread;
+    int running;
+
+    // Sidecar file the index is loaded from and saved to, or NULL.
+    char *path;
+
+    // Bytes of the file covered by the sidecar file, or 0 if there is none.
+    int64_t saved;
+
+    // Set once the sidecar has been written for the first complete build.
+    int built;
+} line_index;
+
+// Suffix appended to the filename for the sidecar file of the line index.
+#define QE_SIDECAR_SUFFIX ".qei"
+
+// Bytes of the file before the end of the indexed region stored in the
+// sidecar, to check the file was only appended to.
+#define QE_SIDECAR_TAIL 64
+
+// Offset of the checkpoints in the sidecar file. Aligned to the largest page
+// size in use (64KiB) so they can be mapped directly into the index on any
+// system.
+#define QE_SIDECAR_DATA (64 << 10)
+
+// Header of the sidecar file, followed at QE_SIDECAR_DATA by the checkpoint
+// offsets. Fields are in native byte order, the index is not portable.
+struct qe_sidecar {
+    char magic[8];
+
+    // Identity of the indexed file and its state when it was indexed.
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    int64_t checkpoint;
+    int64_t count;
+    int64_t pending;
+
+    uint8_t tail[QE_SIDECAR_TAIL];
+};
+
+static const char qe_sidecar_magic[8] = "qeindex2";
+
+// Load the line index from its sidecar file.
+//
+// If it was written for the file as it is now the index is complete at once.
+// If the file has only grown since, the index covers the old part and the
+// builder continues from there. Otherwise nothing is loaded and the index is
+// built from scratch.
+//
+// The checkpoints are mapped privately over the start of <offsets>, so only
+// the pages that are used are read and the builder can append past them.
+static void qe_line_index_load(void)
+{
+    const int fd = open(line_index.path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    struct qe_sidecar h;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || read(fd, &h, sizeof(h)) != (ssize_t) sizeof(h) ||
+            memcmp(h.magic, qe_sidecar_magic, sizeof(h.magic)) != 0 ||
+            h.checkpoint != QE_LINE_CHECKPOINT ||
+            h.dev != (uint64_t) editor.file.st_dev ||
+            h.ino != (uint64_t) editor.file.st_ino ||
+            h.size <= 0 || h.size > editor.file.st_size ||
+            h.count < 1 || h.count > line_index.capacity ||
+            st.st_size < QE_SIDECAR_DATA + h.count * (int64_t) sizeof(int64_t)) {
+        close(fd);
+        return;
+    }
+
+    const int current = h.size == editor.file.st_size &&
+                        h.mtime_sec == editor.file.st_mtim.tv_sec &&
+                        h.mtime_nsec == editor.file.st_mtim.tv_nsec;
+
+    // a file of a different size has to have the same bytes where the index
+    // ended to be an extension of it
+    const int64_t tail = h.size < QE_SIDECAR_TAIL ? h.size : QE_SIDECAR_TAIL;
+    if (!current && (h.size == editor.file.st_size ||
+                     memcmp(h.tail, editor.page + h.size - tail, tail) != 0)) {
+        close(fd);
+        return;
+    }
+
+    void *p = mmap(line_index.offsets, h.count * sizeof(int64_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_FIXED, fd, QE_SIDECAR_DATA);
+    close(fd);
+    if (p == MAP_FAILED) {
+        // the reservation may have been replaced, so start over with a new one
+        munmap(line_index.offsets, line_index.capacity * sizeof(int64_t));
+        line_index.offsets = mmap(NULL, line_index.capacity * sizeof(int64_t),
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (line_index.offsets == MAP_FAILED) {
+            line_index.offsets = NULL;
+        } else {
+            line_index.offsets[0] = 0;
+        }
+        return;
+    }
+
+    line_index.count = h.count;
+    line_index.pending = h.pending;
+    line_index.scanned = h.size;
+    line_index.saved = h.size;
+
+    if (current) {
+        int64_t lines = (line_index.count - 1) * QE_LINE_CHECKPOINT + line_index.pending;
+        if (editor.page[editor.file.st_size - 1] != '\n') {
+            lines += 1;
+        }
+        line_index.lines = lines;
+        line_index.complete = 1;
+    }
+}
+
+// Write the line index to its sidecar file, up to where it has been built.
+// The builder must be stopped. The file is replaced atomically so a concurrent
+// reader never sees a partial index.
+//
+// Failure is not fatal, the index is simply built again next time.
+static void qe_line_index_save(void)
+{
+    const int64_t size = line_index.scanned;
+    struct stat st;
+    if (line_index.path == NULL || size == line_index.saved ||
+            fstat(editor.fd, &st) == -1 || st.st_size < size) {
+        return;
+    }
+
+    struct qe_sidecar h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, qe_sidecar_magic, sizeof(h.magic));
+    h.dev = editor.file.st_dev;
+    h.ino = editor.file.st_ino;
+    h.size = size;
+    h.mtime_sec = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.checkpoint = QE_LINE_CHECKPOINT;
+    h.count = line_index.count;
+    h.pending = line_index.pending;
+
+    const int64_t tail = h.size < QE_SIDECAR_TAIL ? h.size : QE_SIDECAR_TAIL;
+    memcpy(h.tail, editor.page + h.size - tail, tail);
+
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", line_index.path) >= (int) sizeof(tmp)) {
+        return;
+    }
+
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return;
+    }
+
+    // the space between the header and the checkpoints is left as a hole
+    const size_t n = line_index.count * sizeof(int64_t);
+    const int ok = write(fd, &h, sizeof(h)) == (ssize_t) sizeof(h) &&
+                   pwrite(fd, line_index.offsets, n, QE_SIDECAR_DATA) == (ssize_t) n;
+
+    if (close(fd) == -1 || !ok || rename(tmp, line_index.path) == -1) {
+        unlink(tmp);
+        return;
+    }
+    line_index.saved = size;
+}
+
+static void *qe_line_index_build(void *arg)
+{
+    (void) arg;
+
+    const int64_t size = qe_file_size();
+
+    // continue from where a loaded index ended
+    int64_t offset = line_index.scanned;
+
+    // new-lines seen since the last checkpoint
+    int64_t pending = line_index.pending;
+
+    while (offset < size) {
+        if (__atomic_load_n(&line_index.stop, __ATOMIC_RELAXED)) {
+            // kept so the builder can be resumed from <scanned>
+            line_index.pending = pending;
+            return NULL;
+        }
+
+        int64_t end = offset + QE_LINE_INDEX_BLOCK;
+        if (end > size) {
+            end = size;
+        }
+
+        while (offset < end) {
+            int64_t n = QE_LINE_CHECKPOINT - pending;
+            const uint8_t *p = scan.nth(editor.page + offset, end - offset, '\n', &n);
+            if (!p) {
+                pending = QE_LINE_CHECKPOINT - n;
+                offset = end;
+                break;
+            }
+
+            offset = p - editor.page + 1;
+            pending = 0;
+            line_index.offsets[line_index.count] = offset;
+            __atomic_store_n(&line_index.count, line_index.count + 1, __ATOMIC_RELEASE);
+        }
+
+        __atomic_store_n(&line_index.scanned, offset, __ATOMIC_RELEASE);
+    }
+
+    // A trailing new-line does not start another line.
+    int64_t lines = (line_index.count - 1) * QE_LINE_CHECKPOINT + pending;
+    if (size != 0 && editor.page[size - 1] != '\n') {
+        lines += 1;
+    }
+
+    line_index.lines = lines;
+    line_index.pending = pending;
+    __atomic_store_n(&line_index.complete, 1, __ATOMIC_RELEASE);
+    qe_loop_wake();
+    return NULL;
+}
+
+static void qe_line_index_stop(void)
+{
+    if (line_index.running) {
+        __atomic_store_n(&line_index.stop, 1, __ATOMIC_RELAXED);
+        pthread_join(line_index.thread, NULL);
+        line_index.running = 0;
+    }
+}
+
+// Save the sidecar once the first build completes. Later builds, after the
+// file grows, are only saved at exit.
+static void qe_line_index_poll(void)
+{
+    if (line_index.path && !line_index.built &&
+            __atomic_load_n(&line_index.complete, __ATOMIC_ACQUIRE)) {
+        qe_line_index_stop();
+        qe_line_index_save();
+        line_index.built = 1;
+    }
+}
+
+// Stop the builder and save the sidecar with as much as has been indexed, so
+// the next build continues from there.
+static void qe_line_index_exit(void)
+{
+    qe_line_index_stop();
+    qe_line_index_save();
+}
+
+// Start building the line index in the background, or load it from its
+// sidecar file if enabled.
+//
+// Failure is not fatal, movement simply falls back to scanning.
+static void qe_line_index_init(void)
+{
+    line_index.capacity = editor.page_size / QE_LINE_CHECKPOINT + 2;
+    line_index.offsets = mmap(NULL, line_index.capacity * sizeof(int64_t),
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (line_index.offsets == MAP_FAILED) {
+        line_index.offsets = NULL;
+        return;
+    }
+
+    line_index.offsets[0] = 0;
+    line_index.count = 1;
+    atexit(qe_line_index_exit);
+
+    if (editor.sidecar) {
+        line_index.path = malloc(strlen(editor.filename) + sizeof(QE_SIDECAR_SUFFIX));
+        if (line_index.path == NULL) {
+            fatal("failed to allocate sidecar path");
+        }
+        strcpy(line_index.path, editor.filename);
+        strcat(line_index.path, QE_SIDECAR_SUFFIX);
+
+        qe_line_index_load();
+        if (line_index.offsets == NULL || line_index.complete) {
+            return;
+        }
+    }
+
+    if (pthread_create(&line_index.thread, NULL, qe_line_index_build, NULL) != 0) {
+        return;
+    }
+
+    line_index.running = 1;
+}
+
+// Continue the line index over data appended to the file since it was built.
+static void qe_line_index_resume(void)
+{
+    if (line_index.offsets == NULL) {
+        return;
+    }
+
+    qe_line_index_stop();
+    line_index.stop = 0;
+    __atomic_store_n(&line_index.complete, 0, __ATOMIC_RELAXED);
+    if (pthread_create(&line_index.thread, NULL, qe_line_index_build, NULL) == 0) {
+        line_index.running = 1;
+    }
+}
+
+// Drop the checkpoints a new-line written or overwritten at `offset` has
+// moved, and index the file again from the last one left.
+static void qe_line_index_cut(int64_t offset)
+{
+    if (line_index.offsets == NULL) {
+        return;
+    }
+
+    qe_line_index_stop();
+
+    // the first checkpoint is 0, so at least one is kept
+    int64_t lo = 0;
+    int64_t hi = line_index.count;
+    while (hi - lo > 1) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (line_index.offsets[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (line_index.scanned > line_index.offsets[lo]) {
+        line_index.count = lo + 1;
+        line_index.scanned = line_index.offsets[lo];
+        line_index.pending = 0;
+    }
+
+    // the sidecar no longer describes the file
+    if (line_index.path && line_index.saved) {
+        unlink(line_index.path);
+        line_index.saved = 0;
+    }
+
+    qe_line_index_resume();
+}
+
+// How often indexing progress is refreshed in the status line.
+#define QE_PROGRESS_MS 250
+
+// Find the nearest checkpoint at or before `offset`.
+//
+// On success returns 1 and stores the line number of the checkpoint in `line`
+// and its offset in `line_offset`. Returns 0 if `offset` has not been indexed
+// yet, since the distance to it would be unbounded.
+static int qe_line_index_find(int64_t offset, int64_t *line, int64_t *line_offset)
+{
+    if (line_index.offsets == NULL ||
+            offset >= __atomic_load_n(&line_index.scanned, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    // binary search for the last checkpoint <= offset
+    int64_t lo = 0;
+    int64_t hi = __atomic_load_n(&line_index.count, __ATOMIC_ACQUIRE);
+    while (hi - lo > 1) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (line_index.offsets[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *line = lo * QE_LINE_CHECKPOINT;
+    *line_offset = line_index.offsets[lo];
+    return 1;
+}
+
+// Find the nearest indexed checkpoint at or before line `line`.
+//
+// Stores the line number of the checkpoint in `cp_line` and its offset in
+// `cp_offset`. If the index does not reach `line` yet, the last checkpoint is
+// returned.
+static void qe_line_index_seek(int64_t line, int64_t *cp_line, int64_t *cp_offset)
+{
+    int64_t k = line / QE_LINE_CHECKPOINT;
+    if (line_index.offsets == NULL) {
+        *cp_line = 0;
+        *cp_offset = 0;
+        return;
+    }
+
+    const int64_t count = __atomic_load_n(&line_index.count, __ATOMIC_ACQUIRE);
+    if (k >= count) {
+        k = count - 1;
+    }
+
+    *cp_line = k * QE_LINE_CHECKPOINT;
+    *cp_offset = line_index.offsets[k];
+}
+
+// Return the line number of the line starting at `offset`, or -1 if it is
+// beyond the indexed region.
+static int64_t qe_line_number(int64_t offset)
+{
+    int64_t line, line_offset;
+    if (!qe_line_index_find(offset, &line, &line_offset)) {
+        return -1;
+    }
+
+    return line + qe_line_count(line_offset, offset);
+}
+
+static int qe_matches_status(char *buf, size_t n);
+static int qe_terms_status(char *buf, size_t n);
+static int qe_lines_poll(void);
+static int64_t qe_lines_rank(int64_t offset);
+static int64_t qe_lines_offset(int64_t line);
+static int64_t qe_lines_count(void);
+
+// Update the status buffer with the current file status.
+//
+// This keeps track of the filename and current file position. It must be called
+// if page_offset is modified.
+//
+// TODO: Handle page_offset_x movement.
+static void qe_update_status_buffer(void)
+{
+    int64_t through = 0;
+    if (editor.page_offset != 0) {
+        through = 100ll * editor.page_offset / editor.file.st_size;
+    }
+
+    int n = snprintf(editor.status_buffer, sizeof(editor.status_buffer),
+                     "%s: %3"PRId64"%% - %.32s (+%"PRId64") (%"PRId64"/%"PRId64")",
+                     edit_mode_string[editor.mode],
+                     through, editor.filename, editor.page_offset_x,
+                     editor.page_offset + editor.page_offset_x, editor.file.st_size);
+
+    if (editor.record && !editor.hex && n > 0 && (size_t) n < sizeof(editor.status_buffer)) {
+        n += snprintf(editor.status_buffer + n, sizeof(editor.status_buffer) - n,
+                      " [record %"PRId64"/%"PRId64"]",
+                      editor.page_offset / editor.record + 1,
+                      (editor.file.st_size + editor.record - 1) / editor.record);
+    } else if (qe_lines_poll() && n > 0 && (size_t) n < sizeof(editor.status_buffer)) {
+        n += snprintf(editor.status_buffer + n, sizeof(editor.status_buffer) - n,
+                      " [line %"PRId64"/%"PRId64"]",
+                      qe_lines_rank(editor.page_offset) + 1, qe_lines_count());
+    }
+
+    if (line_index.running && !__atomic_load_n(&line_index.complete, __ATOMIC_ACQUIRE) &&
+            n > 0 && (size_t) n < sizeof(editor.status_buffer)) {
+        const int64_t scanned = __atomic_load_n(&line_index.scanned, __ATOMIC_RELAXED);
+        n += snprintf(editor.status_buffer + n, sizeof(editor.status_buffer) - n,
+                      " [indexing %"PRId64"%%]",
+                      editor.file.st_size ? 100 * scanned / editor.file.st_size : 0);
+    }
+
+    if (n > 0 && (size_t) n < sizeof(editor.status_buffer)) {
+        n += qe_matches_status(editor.status_buffer + n, sizeof(editor.status_buffer) - n);
+    }
+
+    if (n > 0 && (size_t) n < sizeof(editor.status_buffer)) {
+        qe_terms_status(editor.status_buffer + n, sizeof(editor.status_buffer) - n);
+    }
+}
+
+// Format a byte count with a binary unit suffix.
+static void qe_format_size(char *buf, size_t n, double bytes)
+{
+    static const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+
+    size_t i = 0;
+    while (bytes >= 1024 && i < sizeof(units) / sizeof(units[0]) - 1) {
+        bytes /= 1024;
+        i += 1;
+    }
+
+    snprintf(buf, n, i == 0 ? "%.0f%s" : "%.1f%s", bytes, units[i]);
+}
+
+// Move the page offset past `n` new-lines. A negative value indicates reverse
+// traversal.
+//
+// Once the full line index is complete the target line is found directly.
+// Until then, small moves scan locally from the current offset. Larger moves
+// resolve the current line number through the checkpoint index, jump to the
+// checkpoint nearest the target line, and scan only the remaining lines from
+// there.
+//
+// In the hex and record views rows are fixed-size and no new-lines are
+// scanned.
+//
+// Stops if the edge of a file is reached.
+static void qe_move_window_y(int32_t n)
+{
+    const int64_t size = qe_row_size();
+    if (size) {
+        // any move is a single computation
+        const int64_t last = (editor.file.st_size - 1) / size * size;
+        int64_t offset = editor.page_offset + (int64_t) n * size;
+        if (offset < 0) {
+            offset = 0;
+        } else if (offset > last) {
+            offset = last;
+        }
+
+        if (offset != editor.page_offset) {
+            editor.page_offset = offset;
+            editor.hex_nibble = 0;
+            editor.dirty = 1;
+        }
+
+        qe_update_status_buffer();
+        return;
+    }
+
+    const int64_t an = n > 0 ? n : -(int64_t) n;
+    int64_t offset = editor.page_offset;
+
+    if (qe_lines_poll()) {
+        // the full index finds the target line directly
+        const int64_t last = qe_lines_count() - 1;
+        int64_t target = qe_lines_rank(offset) + n;
+        if (target < 0) {
+            target = 0;
+        } else if (target > last) {
+            target = last;
+        }
+
+        offset = qe_lines_offset(target);
+        if (offset != editor.page_offset) {
+            editor.page_offset = offset;
+            editor.dirty = 1;
+        }
+
+        qe_update_status_buffer();
+        return;
+    }
+
+    int64_t line = an >= QE_LINE_CHECKPOINT ? qe_line_number(offset) : -1;
+    if (line != -1) {
+        int64_t target = line + n;
+        if (target < 0) {
+            target = 0;
+        }
+
+        int64_t cp_line, cp_offset;
+        qe_line_index_seek(target, &cp_line, &cp_offset);
+
+        // the current position may be closer if the index is still behind
+        if (cp_offset > offset || target < line) {
+            offset = qe_line_forward(cp_offset, target - cp_line);
+        } else {
+            offset = qe_line_forward(offset, target - line);
+        }
+    } else if (n > 0) {
+        offset = qe_line_forward(offset, an);
+    } else {
+        offset = qe_line_backward(offset, an);
+    }
+
+    if (offset != editor.page_offset) {
+        editor.page_offset = offset;
+        editor.dirty = 1;
+    }
+
+    qe_update_status_buffer();
+}
+
+// Shift the buffer view left or right.
+//
+// TODO: Stop shifting if we have buffer is empty.
+static void qe_move_window_x(int32_t n)
+{
+    // the hex view always fits its rows
+    if (editor.hex) {
+        return;
+    }
+
+    editor.page_offset_x += n;
+
+    if (editor.page_offset_x < 0) {
+        editor.page_offset_x = 0;
+        qe_update_status_buffer();
+        return;
+    }
+
+    qe_update_status_buffer();
+    editor.dirty = 1;
+}
+
+// Return the current byte position offset of the cursor.
+//
+// This is used on every cursor movement to check if we are at the end of a
+// line, so the rows above the cursor are skipped with a single new-line scan.
+// With fixed-size rows it is computed directly.
+static int64_t qe_get_cursor_byte_position(void)
+{
+    int64_t offset = editor.page_offset;
+    const int64_t size = qe_row_size();
+    if (size) {
+        offset += editor.cursor_y * size + editor.page_offset_x + editor.cursor_x;
+        return offset < editor.file.st_size ? offset : editor.file.st_size - 1;
+    }
+
+    if (editor.cursor_y != 0) {
+        int64_t n = editor.cursor_y;
+        const uint8_t *p = scan.nth(editor.page + offset, editor.file.st_size - offset, '\n', &n);
+        if (!p) {
+            // eof, return last byte
+            return editor.file.st_size - 1;
+        }
+
+        offset = p - editor.page + 1;
+    }
+
+    offset += editor.page_offset_x + editor.cursor_x;
+
+    // could be passed the end of the file, cap
+    if (offset >= editor.file.st_size) {
+        offset = editor.file.st_size - 1;
+    }
+
+    return offset;
+}
+
+// Put the cursor of a view with fixed-size rows on byte `off`, scrolling the
+// view by as few rows as needed to show it.
+static void qe_row_show(int64_t off)
+{
+    const int64_t size = qe_row_size();
+    const int64_t row = off - off % size;
+    const int64_t rows = terminal.height > 1 ? terminal.height - 1 : 1;
+    if (row < editor.page_offset) {
+        editor.page_offset = row;
+        editor.dirty = 1;
+    } else if (row >= editor.page_offset + rows * size) {
+        editor.page_offset = row - (rows - 1) * size;
+        editor.dirty = 1;
+    }
+
+    // records may be wider than the view
+    const int64_t column = off - row;
+    if (column < editor.page_offset_x || column >= editor.page_offset_x + terminal.width) {
+        editor.page_offset_x = column - column % terminal.width;
+        editor.dirty = 1;
+    }
+
+    editor.cursor_x = column - editor.page_offset_x;
+    editor.cursor_y = (row - editor.page_offset) / size;
+    editor.hex_nibble = 0;
+    editor.dirty_cursor = 1;
+
+    qe_update_status_buffer();
+}
+
+// Maximum number of worker threads.
+#define QE_POOL_MAX 64
+
+// A scan split into <chunks> independent pieces which are run in order on the
+// worker pool.
+//
+// Fields below <chunks> are owned by the pool and guarded by pool.lock.
+struct qe_job {
+    // Process one chunk. Called on a worker without the pool lock held.
+    void (*run)(struct qe_job *job, int64_t chunk);
+
+    // Called on a worker, with the pool lock held, once every claimed chunk
+    // has completed. May be NULL.
+    void (*finish)(struct qe_job *job);
+
+    int64_t chunks;
+
+    // Whether the job only gets workers once no other queued job has chunks
+    // left, so it does not delay searches.
+    int background;
+
+    // Next chunk to hand out.
+    int64_t next;
+
+    // Chunks currently being run.
+    int64_t running;
+
+    // Set once cancelled. Read by chunks without the lock so long running
+    // chunks can stop early.
+    int cancel;
+
+    // Whether the job still has chunks to hand out.
+    int queued;
+
+    // Set once no chunk is running or will run again. The job can then be
+    // freed.
+    int finished;
+
+    struct qe_job *queue_next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+
+    // Signalled when a job is queued.
+    pthread_cond_t work;
+
+    // Broadcast whenever a chunk completes or a job finishes.
+    pthread_cond_t progress;
+
+    // Jobs with chunks left to hand out, in submission order.
+    struct qe_job *head;
+
+    int nthreads;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .progress = PTHREAD_COND_INITIALIZER,
+};
+
+// Must be called with pool.lock held.
+static void qe_pool_unlink(struct qe_job *job)
+{
+    struct qe_job **p = &pool.head;
+    while (*p != job) {
+        p = &(*p)->queue_next;
+    }
+
+    *p = job->queue_next;
+    job->queued = 0;
+}
+
+// Must be called with pool.lock held.
+static void qe_job_update(struct qe_job *job)
+{
+    if (!job->finished && !job->queued && job->running == 0) {
+        job->finished = 1;
+        if (job->finish) {
+            job->finish(job);
+        }
+    }
+
+    pthread_cond_broadcast(&pool.progress);
+}
+
+static void *qe_pool_worker(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        struct qe_job *job = pool.head;
+        if (job == NULL) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+            continue;
+        }
+
+        const int64_t chunk = job->next++;
+        if (job->next == job->chunks) {
+            qe_pool_unlink(job);
+        }
+        job->running += 1;
+
+        pthread_mutex_unlock(&pool.lock);
+        job->run(job, chunk);
+        pthread_mutex_lock(&pool.lock);
+
+        job->running -= 1;
+        qe_job_update(job);
+    }
+
+    return NULL;
+}
+
+// Start the workers, one per online cpu.
+static void qe_pool_init(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        n = 1;
+    } else if (n > QE_POOL_MAX) {
+        n = QE_POOL_MAX;
+    }
+
+    for (long i = 0; i < n; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, qe_pool_worker, NULL) != 0) {
+            break;
+        }
+
+        pthread_detach(thread);
+        pool.nthreads += 1;
+    }
+
+    if (pool.nthreads == 0) {
+        fatal("failed to start worker threads");
+    }
+}
+
+// Queue `job` on the worker pool. The caller initializes <run>, <finish> and
+// <chunks>.
+static void qe_job_submit(struct qe_job *job)
+{
+    if (pool.nthreads == 0) {
+        qe_pool_init();
+    }
+
+    job->next = 0;
+    job->running = 0;
+    job->cancel = 0;
+    job->queued = job->chunks > 0;
+    job->finished = 0;
+    job->queue_next = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    if (job->queued) {
+        struct qe_job **p = &pool.head;
+        while (*p && (job->background || !(*p)->background)) {
+            p = &(*p)->queue_next;
+        }
+        job->queue_next = *p;
+        *p = job;
+        pthread_cond_broadcast(&pool.work);
+    }
+    qe_job_update(job);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Stop handing out chunks of `job`. Chunks already running complete (or stop
+// early if they check <cancel>).
+static void qe_job_cancel(struct qe_job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+    __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+    if (job->queued) {
+        qe_pool_unlink(job);
+    }
+    qe_job_update(job);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Block until `job` has finished.
+static void qe_job_wait(struct qe_job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (!job->finished) {
+        pthread_cond_wait(&pool.progress, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Full line index.
+//
+// Every new-line offset is kept, compressed with Elias-Fano coding, so the
+// line of any offset and the offset of any line are found in near-constant
+// time with no scanning. The file is split into QE_LINES_BLOCK byte blocks,
+// each encoded independently by a chunk on the worker pool. When the file
+// grows only its last, partial, block and the new ones are encoded again.
+//
+// A block with n new-lines at positions v[0..n) relative to its start keeps
+// the low l = floor(log2(size / n)) bits of each packed in <low>, and the
+// rest in <high> as a unary sequence, where value i sets bit (v[i] >> l) + i.
+// That is about 2 + log2(size / n) bits per line, so a little over a byte for
+// lines of 100 bytes.
+
+// Bytes of the file in each block of the full line index.
+#define QE_LINES_BLOCK (4 << 20)
+
+// Words of <high> between entries of its rank directory.
+#define QE_LINES_RANK 8
+
+// Most memory the full line index may use. Movement falls back to the
+// checkpoint index for files that need more.
+#define QE_LINES_MAX ((int64_t) 1 << 30)
+
+struct qe_lines_block {
+    int64_t n;
+    int l;
+    uint64_t *low;
+    uint64_t *high;
+
+    // Ones in <high> before every QE_LINES_RANK words.
+    uint32_t *rank;
+    int64_t nrank;
+
+    // Memory used by the block.
+    int64_t bytes;
+};
+
+struct qe_lines {
+    struct qe_job job;
+
+    struct qe_lines_block *blocks;
+    int64_t nblocks;
+
+    // Bytes of the file covered, and the first block the job encodes.
+    int64_t size;
+    int64_t first;
+
+    // New-lines before each block and in total. Only set once complete.
+    int64_t *prefix;
+    int64_t newlines;
+
+    // Memory used by the blocks so far.
+    int64_t bytes;
+
+    // Set if QE_LINES_MAX was hit, the index is then never complete.
+    int overflow;
+
+    // Set on the main thread once every block has been encoded.
+    int complete;
+};
+
+static void qe_lines_run(struct qe_job *job, int64_t chunk)
+{
+    struct qe_lines *li = (struct qe_lines *) job;
+    struct qe_lines_block *b = &li->blocks[li->first + chunk];
+    if (__atomic_load_n(&li->job.cancel, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&li->overflow, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    const int64_t begin = (li->first + chunk) * QE_LINES_BLOCK;
+    const int64_t size = li->size - begin < QE_LINES_BLOCK ? li->size - begin : QE_LINES_BLOCK;
+    const uint8_t *p = editor.page + begin;
+
+    // Counted first to size the encoding. The block is then in cache for the
+    // second pass.
+    const int64_t n = scan.count(p, size, '\n');
+    if (n == 0) {
+        return;
+    }
+
+    int l = 0;
+    while (n && ((int64_t) 2 << l) * n <= size) {
+        l += 1;
+    }
+
+    // the low bits are read as two words, so keep a spare one
+    const int64_t low_words = (n * l + 63) / 64 + 1;
+    const int64_t high_words = (n + (size >> l) + 1 + 63) / 64;
+    const int64_t nrank = (high_words + QE_LINES_RANK - 1) / QE_LINES_RANK;
+    const int64_t bytes = (low_words + high_words) * 8 + nrank * 4;
+    if (__atomic_add_fetch(&li->bytes, bytes, __ATOMIC_RELAXED) > QE_LINES_MAX) {
+        __atomic_store_n(&li->overflow, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t *low = calloc(low_words, sizeof(uint64_t));
+    uint64_t *high = calloc(high_words, sizeof(uint64_t));
+    uint32_t *rank = malloc(nrank * sizeof(uint32_t));
+    if (low == NULL || high == NULL || rank == NULL) {
+        fatal("failed to allocate line index");
+    }
+
+    const uint64_t mask = ((uint64_t) 1 << l) - 1;
+    int64_t i = 0;
+    for (const uint8_t *q = p; (q = qe_memchr(q, '\n', p + size - q)) != NULL; ++q, ++i) {
+        const uint64_t v = q - p;
+        if (l) {
+            const int64_t bit = i * l;
+            const int s = bit & 63;
+            low[bit >> 6] |= (v & mask) << s;
+            if (s + l > 64) {
+                low[(bit >> 6) + 1] |= (v & mask) >> (64 - s);
+            }
+        }
+
+        const int64_t h = (v >> l) + i;
+        high[h >> 6] |= (uint64_t) 1 << (h & 63);
+    }
+
+    uint32_t ones = 0;
+    for (int64_t w = 0; w < high_words; ++w) {
+        if (w % QE_LINES_RANK == 0) {
+            rank[w / QE_LINES_RANK] = ones;
+        }
+        ones += __builtin_popcountll(high[w]);
+    }
+
+    b->n = n;
+    b->l = l;
+    b->low = low;
+    b->high = high;
+    b->rank = rank;
+    b->nrank = nrank;
+    b->bytes = bytes;
+}
+
+// The last chunk may finish after the loop last looked, so wake it to
+// complete the index.
+static void qe_lines_finish(struct qe_job *job)
+{
+    (void) job;
+    qe_loop_wake();
+}
+
+// Start building the full line index in the background.
+static void qe_lines_start(void)
+{
+    struct qe_lines *li = calloc(1, sizeof(*li));
+    if (li == NULL) {
+        fatal("failed to allocate line index");
+    }
+
+    li->job.run = qe_lines_run;
+    li->job.finish = qe_lines_finish;
+    li->size = editor.file.st_size;
+    li->nblocks = (li->size + QE_LINES_BLOCK - 1) / QE_LINES_BLOCK;
+    li->job.chunks = li->nblocks;
+    li->job.background = 1;
+    li->blocks = calloc(li->nblocks, sizeof(struct qe_lines_block));
+    if (li->blocks == NULL && li->nblocks) {
+        fatal("failed to allocate line index");
+    }
+
+    editor.lines = li;
+    qe_job_submit(&li->job);
+}
+
+// Stop building the full line index and release it. Must be called when a
+// new-line is written or overwritten, as the index no longer reflects the
+// file.
+static void qe_lines_stop(void)
+{
+    struct qe_lines *li = editor.lines;
+    if (li == NULL) {
+        return;
+    }
+
+    qe_job_cancel(&li->job);
+    qe_job_wait(&li->job);
+
+    for (int64_t i = 0; i < li->nblocks; ++i) {
+        free(li->blocks[i].low);
+        free(li->blocks[i].high);
+        free(li->blocks[i].rank);
+    }
+    free(li->blocks);
+    free(li->prefix);
+    free(li);
+    editor.lines = NULL;
+}
+
+// Extend a complete full line index over data appended to the file. It is
+// not usable again until the new blocks are encoded.
+static void qe_lines_extend(void)
+{
+    struct qe_lines *li = editor.lines;
+    if (li == NULL || !li->complete || li->size == editor.file.st_size) {
+        return;
+    }
+
+    const int64_t first = li->size / QE_LINES_BLOCK;
+    const int64_t nblocks = (editor.file.st_size + QE_LINES_BLOCK - 1) / QE_LINES_BLOCK;
+    for (int64_t i = first; i < li->nblocks; ++i) {
+        struct qe_lines_block *b = &li->blocks[i];
+        free(b->low);
+        free(b->high);
+        free(b->rank);
+        li->bytes -= b->bytes;
+    }
+
+    struct qe_lines_block *blocks = realloc(li->blocks, nblocks * sizeof(struct qe_lines_block));
+    if (blocks == NULL) {
+        fatal("failed to allocate line index");
+    }
+    memset(blocks + first, 0, (nblocks - first) * sizeof(struct qe_lines_block));
+
+    li->blocks = blocks;
+    li->nblocks = nblocks;
+    li->size = editor.file.st_size;
+    li->first = first;
+    free(li->prefix);
+    li->prefix = NULL;
+    li->complete = 0;
+
+    li->job.chunks = nblocks - first;
+    qe_job_submit(&li->job);
+}
+
+// Complete the full line index once every block is encoded. Returns whether
+// it is complete and usable for lookups.
+static int qe_lines_poll(void)
+{
+    struct qe_lines *li = editor.lines;
+    if (li == NULL || li->overflow) {
+        return 0;
+    }
+    if (li->complete) {
+        if (li->size != editor.file.st_size) {
+            qe_lines_extend();
+            return 0;
+        }
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    const int finished = li->job.finished;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!finished || li->overflow) {
+        return 0;
+    }
+
+    li->prefix = malloc(li->nblocks * sizeof(int64_t));
+    if (li->prefix == NULL && li->nblocks) {
+        fatal("failed to allocate line index");
+    }
+
+    int64_t n = 0;
+    for (int64_t i = 0; i < li->nblocks; ++i) {
+        li->prefix[i] = n;
+        n += li->blocks[i].n;
+    }
+
+    li->newlines = n;
+    li->complete = 1;
+    if (li->size != editor.file.st_size) {
+        qe_lines_extend();
+        return 0;
+    }
+    return 1;
+}
+
+// Return the position in <high> of one bit `j` (0-based).
+static int64_t qe_lines_select1(const struct qe_lines_block *b, int64_t j)
+{
+    int64_t lo = 0;
+    int64_t hi = b->nrank;
+    while (hi - lo > 1) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (b->rank[mid] <= j) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int64_t w = lo * QE_LINES_RANK;
+    int64_t r = j - b->rank[lo];
+    for (;; ++w) {
+        const int c = __builtin_popcountll(b->high[w]);
+        if (r < c) {
+            break;
+        }
+        r -= c;
+    }
+
+    uint64_t x = b->high[w];
+    while (r-- > 0) {
+        x &= x - 1;
+    }
+    return w * 64 + __builtin_ctzll(x);
+}
+
+// Return the position in <high> of zero bit `j` (0-based).
+static int64_t qe_lines_select0(const struct qe_lines_block *b, int64_t j)
+{
+    int64_t lo = 0;
+    int64_t hi = b->nrank;
+    while (hi - lo > 1) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (mid * QE_LINES_RANK * 64 - b->rank[mid] <= j) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int64_t w = lo * QE_LINES_RANK;
+    int64_t r = j - (lo * QE_LINES_RANK * 64 - b->rank[lo]);
+    for (;; ++w) {
+        const int c = 64 - __builtin_popcountll(b->high[w]);
+        if (r < c) {
+            break;
+        }
+        r -= c;
+    }
+
+    uint64_t x = ~b->high[w];
+    while (r-- > 0) {
+        x &= x - 1;
+    }
+    return w * 64 + __builtin_ctzll(x);
+}
+
+static inline uint64_t qe_lines_low(const struct qe_lines_block *b, int64_t i)
+{
+    if (b->l == 0) {
+        return 0;
+    }
+
+    const int64_t bit = i * b->l;
+    const int s = bit & 63;
+    uint64_t v = b->low[bit >> 6] >> s;
+    if (s + b->l > 64) {
+        v |= b->low[(bit >> 6) + 1] << (64 - s);
+    }
+    return v & (((uint64_t) 1 << b->l) - 1);
+}
+
+// Return the number of new-lines before `offset`, which is the (0-based) line
+// it is on. The index must be complete.
+static int64_t qe_lines_rank(int64_t offset)
+{
+    const struct qe_lines *li = editor.lines;
+    const int64_t k = offset / QE_LINES_BLOCK;
+    if (k >= li->nblocks) {
+        return li->newlines;
+    }
+
+    const struct qe_lines_block *b = &li->blocks[k];
+    const int64_t x = offset - k * QE_LINES_BLOCK;
+    if (b->n == 0) {
+        return li->prefix[k];
+    }
+
+    // values with high part h follow the h-th zero, and are compared by their
+    // low bits
+    const int64_t h = x >> b->l;
+    int64_t pos = h ? qe_lines_select0(b, h - 1) + 1 : 0;
+    int64_t i = pos - h;
+    for (; i < b->n && (b->high[pos >> 6] >> (pos & 63) & 1); ++i, ++pos) {
+        if ((((uint64_t) h << b->l) | qe_lines_low(b, i)) >= (uint64_t) x) {
+            break;
+        }
+    }
+
+    return li->prefix[k] + i;
+}
+
+// Return the offset of the start of line `line` (0-based), which must exist.
+// The index must be complete.
+static int64_t qe_lines_offset(int64_t line)
+{
+    if (line == 0) {
+        return 0;
+    }
+
+    // the line starts after new-line j, in the last block with at most j
+    // new-lines before it
+    const struct qe_lines *li = editor.lines;
+    const int64_t j = line - 1;
+    int64_t lo = 0;
+    int64_t hi = li->nblocks;
+    while (hi - lo > 1) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (li->prefix[mid] <= j) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const struct qe_lines_block *b = &li->blocks[lo];
+    const int64_t i = j - li->prefix[lo];
+    const uint64_t v = (uint64_t) (qe_lines_select1(b, i) - i) << b->l | qe_lines_low(b, i);
+    return lo * QE_LINES_BLOCK + v + 1;
+}
+
+// Return the number of lines in the file. A trailing new-line does not start
+// another line. The index must be complete.
+static int64_t qe_lines_count(void)
+{
+    return editor.lines->newlines +
+           (editor.file.st_size != 0 && editor.page[editor.file.st_size - 1] != '\n');
+}
+
+// Regular expressions.
+//
+// Patterns are parsed into a small syntax tree, which is compiled into
+// Thompson NFAs and run as DFAs built lazily from the bytes actually seen, so
+// matching is linear in the input regardless of the pattern.
+//
+// Supported syntax is the usual subset: literals, '.', bracket classes,
+// \d \w \s (and negations), \xHH, groups, '|', '*', '+', '?', {m}, {m,} and
+// {m,n}, and '^' and '$' anchoring to line boundaries. Matches never span a
+// new-line, which is removed from every byte class.
+//
+// Ignoring case adds the other ASCII case to each class as it is parsed. A
+// pattern that is only a fixed sequence of classes, such as h[ae]llo, is not
+// run as a DFA at all but found directly by the pattern scanner. Neither is
+// an alternation of literals such as ERROR|FATAL|panic, which is found by the
+// term scanner, every start of any term being a match.
+
+// Maximum number of syntax tree nodes in a pattern.
+#define QE_RE_NODES 512
+
+// Largest count accepted in a {m,n} repetition.
+#define QE_RE_REPEAT_MAX 1000
+
+// A prefilter is only used if the position it filters on is estimated to
+// match at most this often (see qe_byte_weight). A common class such as
+// [a-z] would stop at nearly every byte.
+#define QE_RE_PREFILTER_WEIGHT 64
+
+// Maximum number of NFA nodes a pattern may compile to.
+#define QE_PROG_NODES 16384
+
+enum re_op {
+    RE_EMPTY = 0,
+    RE_SET,
+    RE_CAT,
+    RE_ALT,
+    RE_REPEAT,
+    RE_BOL,
+    RE_EOL,
+};
+
+struct re_node {
+    uint8_t op;
+
+    // Children of RE_CAT and RE_ALT. RE_REPEAT only uses <a>.
+    int32_t a;
+    int32_t b;
+
+    // Repetition bounds, <max> is -1 if unbounded.
+    int32_t min;
+    int32_t max;
+
+    // Bytes matched by RE_SET.
+    uint64_t set[4];
+};
+
+struct re_parser {
+    const uint8_t *p;
+    const uint8_t *end;
+
+    struct re_node nodes[QE_RE_NODES];
+    int32_t n;
+
+    // Set on the first error, parsing then unwinds.
+    const char *error;
+
+    // Set if case is ignored.
+    int fold;
+};
+
+static int32_t qe_re_node(struct re_parser *ps, int op, int32_t a, int32_t b)
+{
+    if (ps->n == QE_RE_NODES) {
+        ps->error = "pattern too large";
+        return -1;
+    }
+
+    struct re_node *node = &ps->nodes[ps->n];
+    memset(node, 0, sizeof(*node));
+    node->op = op;
+    node->a = a;
+    node->b = b;
+    return ps->n++;
+}
+
+// Add the bytes of the class escape `c` (one of dDwWsS) to `set`.
+static void qe_re_class(uint64_t *set, int c)
+{
+    uint64_t class[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 256; ++i) {
+        int in;
+        switch (tolower(c)) {
+            case 'd':
+                in = i >= '0' && i <= '9';
+                break;
+            case 'w':
+                in = (i < 0x80 && isalnum(i)) || i == '_';
+                break;
+            default:
+                in = i == ' ' || (i >= '\t' && i <= '\r');
+                break;
+        }
+
+        if (in) {
+            qe_set_add(class, i);
+        }
+    }
+
+    const uint64_t flip = isupper(c) ? ~0ull : 0;
+    for (int i = 0; i < 4; ++i) {
+        set[i] |= class[i] ^ flip;
+    }
+}
+
+// Add the other ASCII case of every letter in `set` if case is ignored. Done
+// before a class is negated, so [^a] matches neither case.
+static void qe_re_fold(const struct re_parser *ps, uint64_t *set)
+{
+    if (!ps->fold) {
+        return;
+    }
+
+    for (int c = 'a'; c <= 'z'; ++c) {
+        if (qe_set_has(set, c) || qe_set_has(set, c - 0x20)) {
+            qe_set_add(set, c);
+            qe_set_add(set, c - 0x20);
+        }
+    }
+}
+
+static int qe_re_hex(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Parse the escape following a backslash. Returns the escaped byte, or -1 if
+// it names a class, whose bytes are added to `set`.
+static int qe_re_escape(struct re_parser *ps, uint64_t *set)
+{
+    if (ps->p == ps->end) {
+        ps->error = "trailing backslash";
+        return -1;
+    }
+
+    const int c = *ps->p++;
+    switch (c) {
+        case 'd':
+        case 'D':
+        case 'w':
+        case 'W':
+        case 's':
+        case 'S':
+            qe_re_class(set, c);
+            return -1;
+
+        case 't':
+            return '\t';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 'f':
+            return '\f';
+        case 'v':
+            return '\v';
+
+        case 'x':
+        {
+            const int hi = ps->end - ps->p >= 2 ? qe_re_hex(ps->p[0]) : -1;
+            const int lo = hi != -1 ? qe_re_hex(ps->p[1]) : -1;
+            if (lo == -1) {
+                ps->error = "bad \\x escape";
+                return -1;
+            }
+            ps->p += 2;
+            return hi << 4 | lo;
+        }
+
+        default:
+            if (isalnum(c)) {
+                ps->error = "unsupported escape";
+                return -1;
+            }
+            return c;
+    }
+}
+
+// Parse a bracket class after the opening '['.
+static int32_t qe_re_parse_class(struct re_parser *ps)
+{
+    const int32_t i = qe_re_node(ps, RE_SET, -1, -1);
+    if (ps->error) {
+        return -1;
+    }
+
+    uint64_t *set = ps->nodes[i].set;
+    int negate = 0;
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+
+    for (int first = 1; ; first = 0) {
+        if (ps->p == ps->end) {
+            ps->error = "missing ]";
+            return -1;
+        }
+
+        int lo = *ps->p++;
+        if (lo == ']' && !first) {
+            break;
+        }
+
+        if (lo == '\\') {
+            lo = qe_re_escape(ps, set);
+            if (lo == -1) {
+                if (ps->error) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+
+        int hi = lo;
+        if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            ps->p++;
+            hi = *ps->p++;
+            if (hi == '\\') {
+                uint64_t ignored[4] = { 0, 0, 0, 0 };
+                hi = qe_re_escape(ps, ignored);
+            }
+            if (hi < lo) {
+                if (!ps->error) {
+                    ps->error = "bad class range";
+                }
+                return -1;
+            }
+        }
+
+        for (int c = lo; c <= hi; ++c) {
+            qe_set_add(set, c);
+        }
+    }
+
+    qe_re_fold(ps, set);
+    if (negate) {
+        for (int k = 0; k < 4; ++k) {
+            set[k] = ~set[k];
+        }
+    }
+
+    return i;
+}
+
+static int32_t qe_re_parse_alt(struct re_parser *ps);
+
+static int32_t qe_re_parse_atom(struct re_parser *ps)
+{
+    const int c = *ps->p++;
+    switch (c) {
+        case '(':
+        {
+            // non-capturing groups are the same thing here
+            if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+            }
+
+            const int32_t i = qe_re_parse_alt(ps);
+            if (ps->error) {
+                return -1;
+            }
+            if (ps->p == ps->end || *ps->p != ')') {
+                ps->error = "missing )";
+                return -1;
+            }
+            ps->p++;
+            return i;
+        }
+
+        case '*':
+        case '+':
+        case '?':
+            ps->error = "nothing to repeat";
+            return -1;
+
+        case '^':
+            return qe_re_node(ps, RE_BOL, -1, -1);
+
+        case '$':
+            return qe_re_node(ps, RE_EOL, -1, -1);
+
+        case '[':
+            return qe_re_parse_class(ps);
+
+        default:
+        {
+            const int32_t i = qe_re_node(ps, RE_SET, -1, -1);
+            if (ps->error) {
+                return -1;
+            }
+
+            uint64_t *set = ps->nodes[i].set;
+            if (c == '.') {
+                set[0] = set[1] = set[2] = set[3] = ~0ull;
+                return i;
+            }
+
+            const int e = c == '\\' ? qe_re_escape(ps, set) : c;
+            if (e != -1) {
+                qe_set_add(set, e);
+            }
+            qe_re_fold(ps, set);
+            return ps->error ? -1 : i;
+        }
+    }
+}
+
+// Parse a {m}, {m,} or {m,n} count after the opening '{'. Returns 0 without
+// consuming anything if it is not a valid count, the brace is then a literal.
+static int qe_re_parse_count(struct re_parser *ps, int32_t *min, int32_t *max)
+{
+    const uint8_t *p = ps->p + 1;
+    int32_t n[2] = { 0, -1 };
+    int k = 0;
+
+    for (;;) {
+        const uint8_t *digits = p;
+        int32_t v = 0;
+        while (p < ps->end && *p >= '0' && *p <= '9') {
+            const int d = *p++ - '0';
+            if (v <= QE_RE_REPEAT_MAX) {
+                v = v * 10 + d;
+            }
+        }
+
+        if (p != digits) {
+            n[k] = v;
+        } else if (k == 0) {
+            return 0;
+        }
+
+        if (p == ps->end) {
+            return 0;
+        }
+        if (*p == '}') {
+            break;
+        }
+        if (*p != ',' || k == 1) {
+            return 0;
+        }
+
+        p++;
+        k = 1;
+    }
+
+    *min = n[0];
+    *max = k == 0 ? n[0] : n[1];
+    if (*min > QE_RE_REPEAT_MAX || *max > QE_RE_REPEAT_MAX || (*max != -1 && *max < *min)) {
+        ps->error = "bad repeat count";
+    }
+
+    ps->p = p + 1;
+    return 1;
+}
+
+static int32_t qe_re_parse_repeat(struct re_parser *ps)
+{
+    int32_t i = qe_re_parse_atom(ps);
+    while (!ps->error && ps->p < ps->end) {
+        int32_t min, max;
+        switch (*ps->p) {
+            case '*':
+                min = 0;
+                max = -1;
+                ps->p++;
+                break;
+            case '+':
+                min = 1;
+                max = -1;
+                ps->p++;
+                break;
+            case '?':
+                min = 0;
+                max = 1;
+                ps->p++;
+                break;
+            case '{':
+                if (qe_re_parse_count(ps, &min, &max)) {
+                    break;
+                }
+                return i;
+            default:
+                return i;
+        }
+
+        if (ps->error) {
+            return -1;
+        }
+
+        // A lazy quantifier only changes which match is preferred, not
+        // whether a line matches.
+        if (ps->p < ps->end && *ps->p == '?') {
+            ps->p++;
+        }
+
+        i = qe_re_node(ps, RE_REPEAT, i, -1);
+        if (ps->error) {
+            return -1;
+        }
+        ps->nodes[i].min = min;
+        ps->nodes[i].max = max;
+    }
+
+    return i;
+}
+
+static int32_t qe_re_parse_cat(struct re_parser *ps)
+{
+    int32_t i = -1;
+    while (!ps->error && ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        const int32_t j = qe_re_parse_repeat(ps);
+        i = i == -1 ? j : qe_re_node(ps, RE_CAT, i, j);
+    }
+
+    return i == -1 ? qe_re_node(ps, RE_EMPTY, -1, -1) : i;
+}
+
+static int32_t qe_re_parse_alt(struct re_parser *ps)
+{
+    int32_t i = qe_re_parse_cat(ps);
+    while (!ps->error && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        const int32_t j = qe_re_parse_cat(ps);
+        i = qe_re_node(ps, RE_ALT, i, j);
+    }
+
+    return ps->error ? -1 : i;
+}
+
+// Append to `pre` the sets every match of node `i` starts with, or ends with
+// if `reverse`, in scan order. Returns whether the whole node is those sets,
+// in which case the prefix continues into what follows.
+static int qe_re_prefix(const struct re_parser *ps, int32_t i, int reverse, struct qe_pattern *pre)
+{
+    const struct re_node *node = &ps->nodes[i];
+    switch (node->op) {
+        case RE_EMPTY:
+            return 1;
+
+        // An anchor at the start only constrains where the prefix may be.
+        case RE_BOL:
+            return !reverse;
+        case RE_EOL:
+            return reverse;
+
+        case RE_CAT:
+            return qe_re_prefix(ps, reverse ? node->b : node->a, reverse, pre) &&
+                   qe_re_prefix(ps, reverse ? node->a : node->b, reverse, pre);
+
+        case RE_SET:
+            if (pre->len == QE_PATTERN_MAX) {
+                return 0;
+            }
+            memcpy(pre->set[pre->len], node->set, sizeof(node->set));
+            pre->set[pre->len]['\n' >> 6] &= ~(1ull << ('\n' & 63));
+            pre->len += 1;
+            return 1;
+
+        case RE_REPEAT:
+            for (int32_t k = 0; k < node->min; ++k) {
+                if (!qe_re_prefix(ps, node->a, reverse, pre)) {
+                    return 0;
+                }
+            }
+            return node->min == node->max;
+
+        default:
+            return 0;
+    }
+}
+
+// Return whether node `i` matches exactly a fixed sequence of byte sets, with
+// no anchors, appending them to `t`.
+static int qe_re_fixed(const struct re_parser *ps, int32_t i, struct qe_pattern *t)
+{
+    const struct re_node *node = &ps->nodes[i];
+    switch (node->op) {
+        case RE_EMPTY:
+            return 1;
+
+        case RE_CAT:
+            return qe_re_fixed(ps, node->a, t) && qe_re_fixed(ps, node->b, t);
+
+        case RE_SET:
+            return qe_re_prefix(ps, i, 0, t);
+
+        case RE_REPEAT:
+            if (node->min != node->max) {
+                return 0;
+            }
+            for (int32_t k = 0; k < node->min; ++k) {
+                if (!qe_re_fixed(ps, node->a, t)) {
+                    return 0;
+                }
+            }
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+// Append to `t` the alternatives of node `i`. Returns 0 unless each is a
+// literal, with a case pair in place of each letter if case is ignored.
+static int qe_re_terms(const struct re_parser *ps, int32_t i, struct qe_terms *t)
+{
+    const struct re_node *node = &ps->nodes[i];
+    if (node->op == RE_ALT) {
+        return qe_re_terms(ps, node->a, t) && qe_re_terms(ps, node->b, t);
+    }
+
+    struct qe_pattern p;
+    p.len = 0;
+    if (!qe_re_fixed(ps, i, &p) || p.len == 0 || t->n == QE_TERMS_MAX) {
+        return 0;
+    }
+
+    const size_t used = t->n ? t->off[t->n - 1] + t->len[t->n - 1] : 0;
+    if (used + p.len > QE_TERMS_BYTES) {
+        return 0;
+    }
+
+    for (size_t k = 0; k < p.len; ++k) {
+        struct qe_class c;
+        if (!qe_class_init(&c, p.set[k])) {
+            return 0;
+        }
+
+        const int letter = c.lo[0] >= 'a' && c.lo[0] <= 'z';
+        if (c.kind != CLASS_BYTE && !(c.kind == CLASS_FOLD && ps->fold && letter)) {
+            return 0;
+        }
+        t->bytes[used + k] = c.lo[0];
+    }
+
+    t->off[t->n] = used;
+    t->len[t->n] = p.len;
+    t->n += 1;
+    return 1;
+}
+
+enum nfa_op {
+    NFA_SET = 0,
+    NFA_SPLIT,
+    NFA_BOL,
+    NFA_EOL,
+    NFA_MATCH,
+};
+
+struct nfa_node {
+    uint8_t op;
+
+    // For NFA_EOL, whether a match follows directly, bit 0 when not at the
+    // start of a line and bit 1 when at one.
+    uint8_t eol;
+
+    // Next node, and the alternative for NFA_SPLIT.
+    int32_t out;
+    int32_t out1;
+
+    // Bytes consumed by NFA_SET. Never contains a new-line.
+    uint64_t set[4];
+};
+
+// A compiled pattern, run in one direction over the file.
+//
+// Programs for backward scanning are compiled from the reversed pattern with
+// the line anchors swapped, so the same DFA runs them in either direction.
+// Line start and end below are in scan direction.
+struct qe_prog {
+    struct nfa_node *nodes;
+    int32_t len;
+    int32_t cap;
+    int32_t start;
+
+    // Whether a match may start anywhere, rather than only at the position
+    // scanning starts from.
+    int unanchored;
+
+    // Sets every match starts with in scan direction, in file order. Used to
+    // skip ahead with the pattern scanner. Only set if unanchored and the
+    // sets are selective enough.
+    struct qe_pattern pre;
+};
+
+static int32_t qe_prog_node(struct qe_prog *prog, int op, int32_t out, int32_t out1)
+{
+    if (prog->len == prog->cap) {
+        if (prog->cap == QE_PROG_NODES) {
+            return -1;
+        }
+
+        const int32_t cap = prog->cap ? 2 * prog->cap : 64;
+        struct nfa_node *nodes = realloc(prog->nodes, cap * sizeof(struct nfa_node));
+        if (nodes == NULL) {
+            fatal("failed to allocate pattern");
+        }
+        prog->nodes = nodes;
+        prog->cap = cap;
+    }
+
+    struct nfa_node *node = &prog->nodes[prog->len];
+    memset(node, 0, sizeof(*node));
+    node->op = op;
+    node->out = out;
+    node->out1 = out1;
+    return prog->len++;
+}
+
+// Emit the nodes for syntax node `i`, continuing into node `next` once it has
+// matched. Built back to front so every node knows its successor. Returns the
+// entry node, or -1 if the program is too large.
+static int32_t qe_prog_emit(struct qe_prog *prog, const struct re_parser *ps,
+                            int32_t i, int32_t next, int reverse)
+{
+    const struct re_node *node = &ps->nodes[i];
+    switch (node->op) {
+        case RE_SET:
+        {
+            const int32_t n = qe_prog_node(prog, NFA_SET, next, -1);
+            if (n != -1) {
+                memcpy(prog->nodes[n].set, node->set, sizeof(node->set));
+                prog->nodes[n].set['\n' >> 6] &= ~(1ull << ('\n' & 63));
+            }
+            return n;
+        }
+
+        case RE_BOL:
+        case RE_EOL:
+            return qe_prog_node(prog, (node->op == RE_BOL) != reverse ? NFA_BOL : NFA_EOL, next, -1);
+
+        case RE_CAT:
+        {
+            const int32_t n = qe_prog_emit(prog, ps, reverse ? node->a : node->b, next, reverse);
+            return n == -1 ? -1 : qe_prog_emit(prog, ps, reverse ? node->b : node->a, n, reverse);
+        }
+
+        case RE_ALT:
+        {
+            const int32_t a = qe_prog_emit(prog, ps, node->a, next, reverse);
+            const int32_t b = a == -1 ? -1 : qe_prog_emit(prog, ps, node->b, next, reverse);
+            return b == -1 ? -1 : qe_prog_node(prog, NFA_SPLIT, a, b);
+        }
+
+        case RE_REPEAT:
+        {
+            int32_t n = next;
+            if (node->max == -1) {
+                const int32_t loop = qe_prog_node(prog, NFA_SPLIT, -1, next);
+                const int32_t body = loop == -1 ? -1 : qe_prog_emit(prog, ps, node->a, loop, reverse);
+                if (body == -1) {
+                    return -1;
+                }
+                prog->nodes[loop].out = body;
+                n = loop;
+            }
+
+            // each optional copy may be followed by another
+            for (int32_t k = node->min; k < node->max; ++k) {
+                const int32_t body = qe_prog_emit(prog, ps, node->a, n, reverse);
+                n = body == -1 ? -1 : qe_prog_node(prog, NFA_SPLIT, body, next);
+                if (n == -1) {
+                    return -1;
+                }
+            }
+
+            for (int32_t k = 0; k < node->min && n != -1; ++k) {
+                n = qe_prog_emit(prog, ps, node->a, n, reverse);
+            }
+            return n;
+        }
+
+        default:
+            return next;
+    }
+}
+
+// Whether a match is reachable from node `i` without consuming a byte, at a
+// position where every line end assertion holds.
+static int qe_prog_eol(const struct qe_prog *prog, int32_t i, int bol, uint8_t *seen)
+{
+    while (i != -1 && !seen[i]) {
+        seen[i] = 1;
+
+        const struct nfa_node *node = &prog->nodes[i];
+        switch (node->op) {
+            case NFA_MATCH:
+                return 1;
+            case NFA_SPLIT:
+                if (qe_prog_eol(prog, node->out1, bol, seen)) {
+                    return 1;
+                }
+                i = node->out;
+                break;
+            case NFA_BOL:
+                i = bol ? node->out : -1;
+                break;
+            case NFA_EOL:
+                i = node->out;
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    return 0;
+}
+
+// Compile the syntax tree rooted at `root`. Returns 0 on success or -1 if the
+// pattern is too large.
+static int qe_prog_compile(struct qe_prog *prog, const struct re_parser *ps,
+                           int32_t root, int reverse, int unanchored)
+{
+    const int32_t match = qe_prog_node(prog, NFA_MATCH, -1, -1);
+    if (match == -1) {
+        return -1;
+    }
+
+    prog->start = qe_prog_emit(prog, ps, root, match, reverse);
+    if (prog->start == -1) {
+        return -1;
+    }
+
+    // An unanchored program loops over any byte of the line before the
+    // pattern, so a match may start at every position.
+    if (unanchored) {
+        const int32_t split = qe_prog_node(prog, NFA_SPLIT, prog->start, -1);
+        const int32_t loop = split == -1 ? -1 : qe_prog_node(prog, NFA_SET, split, -1);
+        if (loop == -1) {
+            return -1;
+        }
+
+        memset(prog->nodes[loop].set, 0xff, sizeof(prog->nodes[loop].set));
+        prog->nodes[loop].set['\n' >> 6] &= ~(1ull << ('\n' & 63));
+        prog->nodes[split].out1 = loop;
+        prog->start = split;
+        prog->unanchored = 1;
+
+        // collected in scan order
+        struct qe_pattern *pre = &prog->pre;
+        qe_re_prefix(ps, root, reverse, pre);
+        for (size_t k = 0; reverse && k < pre->len / 2; ++k) {
+            uint64_t t[4];
+            memcpy(t, pre->set[k], sizeof(t));
+            memcpy(pre->set[k], pre->set[pre->len - 1 - k], sizeof(t));
+            memcpy(pre->set[pre->len - 1 - k], t, sizeof(t));
+        }
+
+        qe_pattern_prepare(pre);
+        if (!pre->filter || pre->weight > QE_RE_PREFILTER_WEIGHT) {
+            pre->len = 0;
+        }
+    }
+
+    uint8_t *seen = malloc(prog->len);
+    if (seen == NULL) {
+        fatal("failed to allocate pattern");
+    }
+
+    for (int32_t i = 0; i < prog->len; ++i) {
+        struct nfa_node *node = &prog->nodes[i];
+        if (node->op == NFA_EOL) {
+            for (int bol = 0; bol < 2; ++bol) {
+                memset(seen, 0, prog->len);
+                if (qe_prog_eol(prog, node->out, bol, seen)) {
+                    node->eol |= 1 << bol;
+                }
+            }
+        }
+    }
+
+    free(seen);
+    return 0;
+}
+
+// A compiled regular expression, or a case-insensitive literal.
+struct qe_regex {
+    // Finds where the first match ends scanning forward.
+    struct qe_prog find;
+
+    // Finds where the longest match ends scanning forward from its start.
+    struct qe_prog end;
+
+    // Finds where the last match starts scanning backward.
+    struct qe_prog rfind;
+
+    // If every match is a fixed sequence of byte sets, they are searched for
+    // with the pattern scanner instead of the programs, like a literal. Else
+    // NULL.
+    struct qe_pattern *pattern;
+
+    // If the pattern is an alternation of literals, they are searched for
+    // with the term scanner, every start of each being a match. Else NULL.
+    struct qe_terms *terms;
+
+    // Set if compiled from a literal or hex term, which only has <pattern>.
+    int literal;
+
+    // Set if case is ignored.
+    int fold;
+
+    // Set if compiled from a hex term.
+    int hex;
+};
+
+static void qe_regex_free(struct qe_regex *re)
+{
+    if (re == NULL) {
+        return;
+    }
+
+    free(re->find.nodes);
+    free(re->end.nodes);
+    free(re->rfind.nodes);
+    free(re->pattern);
+    free(re->terms);
+    free(re);
+}
+
+// Compile `pattern`, ignoring case if `fold`. Returns NULL and sets `error` if
+// it is invalid.
+static struct qe_regex *qe_regex_compile(const uint8_t *pattern, size_t len, int fold, const char **error)
+{
+    struct re_parser ps;
+    ps.p = pattern;
+    ps.end = pattern + len;
+    ps.n = 0;
+    ps.error = NULL;
+    ps.fold = fold;
+
+    const int32_t root = qe_re_parse_alt(&ps);
+    if (!ps.error && ps.p != ps.end) {
+        ps.error = "unmatched )";
+    }
+    if (ps.error) {
+        *error = ps.error;
+        return NULL;
+    }
+
+    struct qe_regex *re = calloc(1, sizeof(*re));
+    if (re == NULL) {
+        fatal("failed to allocate pattern");
+    }
+    re->fold = fold;
+
+    if (qe_prog_compile(&re->find, &ps, root, 0, 1) ||
+            qe_prog_compile(&re->end, &ps, root, 0, 0) ||
+            qe_prog_compile(&re->rfind, &ps, root, 1, 1)) {
+        qe_regex_free(re);
+        *error = "pattern too large";
+        return NULL;
+    }
+
+    struct qe_pattern t;
+    t.len = 0;
+    if (qe_re_fixed(&ps, root, &t) && t.len != 0) {
+        re->pattern = malloc(sizeof(t));
+        if (re->pattern == NULL) {
+            fatal("failed to allocate pattern");
+        }
+        qe_pattern_prepare(&t);
+        *re->pattern = t;
+    } else if (ps.nodes[root].op == RE_ALT) {
+        struct qe_terms *terms = calloc(1, sizeof(*terms));
+        if (terms == NULL) {
+            fatal("failed to allocate pattern");
+        }
+        terms->fold = fold;
+        if (qe_re_terms(&ps, root, terms)) {
+            qe_terms_prepare(terms);
+            re->terms = terms;
+        } else {
+            free(terms);
+        }
+    }
+
+    return re;
+}
+
+// Compile the literal `term` to be matched ignoring case.
+static struct qe_regex *qe_regex_literal(const uint8_t *term, size_t len)
+{
+    struct qe_regex *re = calloc(1, sizeof(*re));
+    struct qe_pattern *t = calloc(1, sizeof(*t));
+    if (re == NULL || t == NULL) {
+        fatal("failed to allocate pattern");
+    }
+
+    for (size_t i = 0; i < len && i < QE_PATTERN_MAX; ++i) {
+        qe_set_add(t->set[i], term[i]);
+        if (isalpha(term[i])) {
+            qe_set_add(t->set[i], term[i] ^ 0x20);
+        }
+        t->len += 1;
+    }
+    qe_pattern_prepare(t);
+
+    re->pattern = t;
+    re->literal = 1;
+    re->fold = 1;
+    return re;
+}
+
+// Compile the hex term `term`, such as "7f 45 4c 46" or "4d5a??00". A '?' in
+// place of a digit matches any nibble there. Returns NULL and sets `error` if
+// it is invalid.
+static struct qe_regex *qe_regex_hex(const uint8_t *term, size_t len, const char **error)
+{
+    struct qe_pattern t;
+    t.len = 0;
+
+    // digits of each byte, -1 for a wildcard
+    int nibble[2];
+    int n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const int c = term[i];
+        if (isspace(c)) {
+            if (n != 0) {
+                *error = "odd number of hex digits";
+                return NULL;
+            }
+            continue;
+        }
+
+        if (c != '?' && qe_re_hex(c) == -1) {
+            *error = "bad hex digit";
+            return NULL;
+        }
+        nibble[n++] = c == '?' ? -1 : qe_re_hex(c);
+        if (n < 2) {
+            continue;
+        }
+
+        if (t.len == QE_PATTERN_MAX) {
+            *error = "pattern too long";
+            return NULL;
+        }
+        memset(t.set[t.len], 0, sizeof(t.set[t.len]));
+        for (int b = 0; b < 256; ++b) {
+            if ((nibble[0] == -1 || b >> 4 == nibble[0]) && (nibble[1] == -1 || (b & 15) == nibble[1])) {
+                qe_set_add(t.set[t.len], b);
+            }
+        }
+        t.len += 1;
+        n = 0;
+    }
+
+    if (n != 0) {
+        *error = "odd number of hex digits";
+        return NULL;
+    }
+    if (t.len == 0) {
+        *error = "no hex bytes";
+        return NULL;
+    }
+
+    struct qe_regex *re = calloc(1, sizeof(*re));
+    struct qe_pattern *pattern = malloc(sizeof(t));
+    if (re == NULL || pattern == NULL) {
+        fatal("failed to allocate pattern");
+    }
+    qe_pattern_prepare(&t);
+    *pattern = t;
+    re->pattern = pattern;
+    re->literal = 1;
+    re->hex = 1;
+    return re;
+}
+
+// Maximum number of states cached by a lazy DFA. Once full the cache is
+// flushed and rebuilt from the bytes seen next.
+#define QE_DFA_STATES 1024
+
+// Maximum number of NFA node ids stored across all cached states.
+#define QE_DFA_SETS (1 << 18)
+
+// States every DFA starts with, kept at the same ids across flushes.
+enum dfa_fixed {
+    DFA_DEAD = 0,
+    DFA_MATCHED,
+    DFA_START,
+    DFA_START_BOL,
+};
+
+// A match ends at the current position.
+#define DFA_MATCH 1
+
+// A match ends at the current position if it is a line end.
+#define DFA_EOL 2
+
+// The match ended before the last byte scanned (a line end). Only set on
+// DFA_MATCHED.
+#define DFA_BEFORE 4
+
+struct dfa_state {
+    // Sorted NFA_SET node ids in <sets>.
+    uint32_t set;
+    uint32_t len;
+
+    uint8_t flags;
+
+    // Next state in the same hash bucket, or -1.
+    int32_t hash_next;
+};
+
+// A DFA built lazily from a program.
+//
+// Each state is the set of NFA_SET nodes reachable so far, and transitions are
+// only computed the first time they are taken. Not thread safe, every worker
+// runs its own.
+struct qe_dfa {
+    const struct qe_prog *prog;
+
+    // 256 transitions per state, -1 if not yet computed.
+    int32_t *trans;
+
+    struct dfa_state *states;
+    int32_t nstates;
+
+    int32_t *sets;
+    uint32_t sets_len;
+
+    int32_t *buckets;
+
+    // Scratch for computing the next state.
+    int32_t *stack;
+    int32_t *scratch;
+    int32_t *saved;
+    uint32_t scratch_len;
+    uint8_t scratch_flags;
+    uint32_t *mark;
+    uint32_t gen;
+
+    // Number of times the cache has been flushed.
+    uint32_t flushes;
+};
+
+#define QE_DFA_BUCKETS (2 * QE_DFA_STATES)
+
+static void qe_dfa_begin(struct qe_dfa *dfa)
+{
+    dfa->scratch_len = 0;
+    dfa->scratch_flags = 0;
+    dfa->gen += 1;
+}
+
+// Add node `i` and every node reachable from it without consuming a byte to
+// the scratch state. `bol` is whether the position is at a line start.
+static void qe_dfa_closure(struct qe_dfa *dfa, int32_t i, int bol)
+{
+    const struct nfa_node *nodes = dfa->prog->nodes;
+    int32_t n = 0;
+
+    // nodes are marked when pushed so the stack never exceeds the program
+#define QE_DFA_PUSH(x)                                                          \
+    do {                                                                        \
+        if ((x) != -1 && dfa->mark[x] != dfa->gen) {                            \
+            dfa->mark[x] = dfa->gen;                                            \
+            dfa->stack[n++] = (x);                                              \
+        }                                                                       \
+    } while (0)
+
+    QE_DFA_PUSH(i);
+    while (n != 0) {
+        const int32_t x = dfa->stack[--n];
+        const struct nfa_node *node = &nodes[x];
+        switch (node->op) {
+            case NFA_SET:
+                dfa->scratch[dfa->scratch_len++] = x;
+                break;
+            case NFA_MATCH:
+                dfa->scratch_flags |= DFA_MATCH;
+                break;
+            case NFA_EOL:
+                if (node->eol & (bol ? 2 : 1)) {
+                    dfa->scratch_flags |= DFA_EOL;
+                }
+                break;
+            case NFA_BOL:
+                if (bol) {
+                    QE_DFA_PUSH(node->out);
+                }
+                break;
+            case NFA_SPLIT:
+                QE_DFA_PUSH(node->out1);
+                QE_DFA_PUSH(node->out);
+                break;
+        }
+    }
+
+#undef QE_DFA_PUSH
+}
+
+static int qe_dfa_cmp(const void *a, const void *b)
+{
+    const int32_t x = *(const int32_t *) a;
+    const int32_t y = *(const int32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t qe_dfa_hash(const struct qe_dfa *dfa)
+{
+    uint32_t h = 2166136261u ^ dfa->scratch_flags;
+    for (uint32_t i = 0; i < dfa->scratch_len; ++i) {
+        h = (h ^ (uint32_t) dfa->scratch[i]) * 16777619u;
+    }
+
+    return h & (QE_DFA_BUCKETS - 1);
+}
+
+// Add the scratch state to the cache, which must have room for it.
+static int32_t qe_dfa_insert(struct qe_dfa *dfa, uint32_t h)
+{
+    const int32_t s = dfa->nstates++;
+    struct dfa_state *st = &dfa->states[s];
+    st->set = dfa->sets_len;
+    st->len = dfa->scratch_len;
+    st->flags = dfa->scratch_flags;
+    st->hash_next = dfa->buckets[h];
+    dfa->buckets[h] = s;
+
+    memcpy(dfa->sets + dfa->sets_len, dfa->scratch, dfa->scratch_len * sizeof(int32_t));
+    dfa->sets_len += dfa->scratch_len;
+
+    int32_t *row = dfa->trans + (size_t) s * 256;
+    for (int c = 0; c < 256; ++c) {
+        row[c] = -1;
+    }
+    return s;
+}
+
+static void qe_dfa_flush(struct qe_dfa *dfa)
+{
+    dfa->nstates = 0;
+    dfa->sets_len = 0;
+    for (int32_t i = 0; i < QE_DFA_BUCKETS; ++i) {
+        dfa->buckets[i] = -1;
+    }
+
+    qe_dfa_begin(dfa);
+    qe_dfa_insert(dfa, qe_dfa_hash(dfa));
+    dfa->scratch_flags = DFA_MATCH | DFA_BEFORE;
+    qe_dfa_insert(dfa, qe_dfa_hash(dfa));
+
+    // neither state can lead anywhere else
+    for (int c = 0; c < 256; ++c) {
+        dfa->trans[DFA_DEAD * 256 + c] = DFA_DEAD;
+        dfa->trans[DFA_MATCHED * 256 + c] = DFA_DEAD;
+    }
+
+    for (int bol = 0; bol < 2; ++bol) {
+        qe_dfa_begin(dfa);
+        qe_dfa_closure(dfa, dfa->prog->start, bol);
+        qsort(dfa->scratch, dfa->scratch_len, sizeof(int32_t), qe_dfa_cmp);
+        qe_dfa_insert(dfa, qe_dfa_hash(dfa));
+    }
+
+    dfa->flushes += 1;
+}
+
+// Return the id of the scratch state, adding it to the cache if needed.
+static int32_t qe_dfa_add(struct qe_dfa *dfa)
+{
+    qsort(dfa->scratch, dfa->scratch_len, sizeof(int32_t), qe_dfa_cmp);
+
+    uint32_t h = qe_dfa_hash(dfa);
+    for (int32_t s = dfa->buckets[h]; s != -1; s = dfa->states[s].hash_next) {
+        const struct dfa_state *st = &dfa->states[s];
+        if (st->flags == dfa->scratch_flags && st->len == dfa->scratch_len &&
+                !memcmp(dfa->sets + st->set, dfa->scratch, st->len * sizeof(int32_t))) {
+            return s;
+        }
+    }
+
+    if (dfa->nstates == QE_DFA_STATES || dfa->sets_len + dfa->scratch_len > QE_DFA_SETS) {
+        // flushing rebuilds the start states in the scratch space
+        const uint32_t len = dfa->scratch_len;
+        const uint8_t flags = dfa->scratch_flags;
+        memcpy(dfa->saved, dfa->scratch, len * sizeof(int32_t));
+
+        qe_dfa_flush(dfa);
+
+        memcpy(dfa->scratch, dfa->saved, len * sizeof(int32_t));
+        dfa->scratch_len = len;
+        dfa->scratch_flags = flags;
+    }
+
+    return qe_dfa_insert(dfa, h);
+}
+
+// Compute the transition from state `s` on byte `c`.
+static int32_t qe_dfa_compute(struct qe_dfa *dfa, int32_t s, uint8_t c)
+{
+    const struct dfa_state *st = &dfa->states[s];
+    int32_t t;
+
+    if (c == '\n') {
+        // Nothing consumes a new-line. Either a match ends at the line end, or
+        // an unanchored program starts again on the next line.
+        if (st->flags & DFA_EOL) {
+            t = DFA_MATCHED;
+        } else {
+            t = dfa->prog->unanchored ? DFA_START_BOL : DFA_DEAD;
+        }
+    } else {
+        qe_dfa_begin(dfa);
+        const int32_t *set = dfa->sets + st->set;
+        for (uint32_t i = 0; i < st->len; ++i) {
+            const struct nfa_node *node = &dfa->prog->nodes[set[i]];
+            if (qe_set_has(node->set, c)) {
+                qe_dfa_closure(dfa, node->out, 0);
+            }
+        }
+
+        const uint32_t flushes = dfa->flushes;
+        t = qe_dfa_add(dfa);
+        if (dfa->flushes != flushes) {
+            // the row of `s` is gone
+            return t;
+        }
+    }
+
+    dfa->trans[(size_t) s * 256 + c] = t;
+    return t;
+}
+
+static void qe_dfa_init(struct qe_dfa *dfa, const struct qe_prog *prog)
+{
+    memset(dfa, 0, sizeof(*dfa));
+    dfa->prog = prog;
+
+    // Rows are only touched once their state is added, so the transition
+    // table costs memory in proportion to the states actually built.
+    dfa->trans = malloc((size_t) QE_DFA_STATES * 256 * sizeof(int32_t));
+    dfa->states = malloc(QE_DFA_STATES * sizeof(struct dfa_state));
+    dfa->sets = malloc(QE_DFA_SETS * sizeof(int32_t));
+    dfa->buckets = malloc(QE_DFA_BUCKETS * sizeof(int32_t));
+    dfa->stack = malloc(prog->len * sizeof(int32_t));
+    dfa->scratch = malloc(prog->len * sizeof(int32_t));
+    dfa->saved = malloc(prog->len * sizeof(int32_t));
+    dfa->mark = calloc(prog->len, sizeof(uint32_t));
+    if (dfa->trans == NULL || dfa->states == NULL || dfa->sets == NULL || dfa->buckets == NULL ||
+            dfa->stack == NULL || dfa->scratch == NULL || dfa->saved == NULL || dfa->mark == NULL) {
+        fatal("failed to allocate pattern state");
+    }
+
+    qe_dfa_flush(dfa);
+}
+
+static void qe_dfa_free(struct qe_dfa *dfa)
+{
+    free(dfa->trans);
+    free(dfa->states);
+    free(dfa->sets);
+    free(dfa->buckets);
+    free(dfa->stack);
+    free(dfa->scratch);
+    free(dfa->saved);
+    free(dfa->mark);
+}
+
+static inline int32_t qe_dfa_next(struct qe_dfa *dfa, int32_t s, uint8_t c)
+{
+    const int32_t t = dfa->trans[(size_t) s * 256 + c];
+    return t != -1 ? t : qe_dfa_compute(dfa, s, c);
+}
+
+// Whether state `s` holds a match if the current position is a line end.
+static inline int qe_dfa_eol(const struct qe_dfa *dfa, int32_t s)
+{
+    return dfa->states[s].flags & DFA_EOL;
+}
+
+// Run `dfa` forward over the file bytes [from, to) from state `*s`. Returns
+// the offset the first match found ends at or, if `longest`, the last one
+// found before the dfa dies. Returns -1 if there is none. The literal
+// prefilter may read up to `limit`.
+//
+// While no match is in progress, the prefilter skips directly to the next
+// occurrence of the literal every match starts with.
+static int64_t qe_dfa_forward(struct qe_dfa *dfa, int64_t from, int64_t to, int64_t limit,
+                              int32_t *s, int longest)
+{
+    const struct qe_prog *prog = dfa->prog;
+    const uint8_t *page = editor.page;
+    int32_t state = *s;
+    int64_t match = -1;
+
+    if (dfa->states[state].flags & DFA_MATCH) {
+        if (!longest) {
+            return from;
+        }
+        match = from;
+    }
+
+    for (int64_t i = from; i < to; ) {
+        if (prog->pre.len && (state == DFA_START || state == DFA_START_BOL)) {
+            // candidate starts are [i, to)
+            int64_t n = to + prog->pre.len - 1;
+            if (n > limit) {
+                n = limit;
+            }
+
+            const uint8_t *q = scan.pmem(page + i, n - i, &prog->pre);
+            if (!q || q - page >= to) {
+                *s = page[to - 1] == '\n' ? DFA_START_BOL : DFA_START;
+                return match;
+            }
+
+            if (q - page > i) {
+                i = q - page;
+                state = page[i - 1] == '\n' ? DFA_START_BOL : DFA_START;
+            }
+        }
+
+        state = qe_dfa_next(dfa, state, page[i++]);
+
+        const uint8_t flags = dfa->states[state].flags;
+        if (flags & DFA_MATCH) {
+            match = flags & DFA_BEFORE ? i - 1 : i;
+            if (!longest) {
+                break;
+            }
+        }
+
+        if (longest && (state == DFA_DEAD || state == DFA_MATCHED)) {
+            break;
+        }
+    }
+
+    *s = state;
+    return match;
+}
+
+// Run `dfa` backward over the file bytes [from, to) from state `*s`. Returns
+// the offset of the first match start found or, if `longest`, of the last one
+// found before the dfa dies. Returns -1 if there is none. The literal
+// prefilter may read down to `limit`.
+static int64_t qe_dfa_backward(struct qe_dfa *dfa, int64_t from, int64_t to, int64_t limit,
+                               int32_t *s, int longest)
+{
+    const struct qe_prog *prog = dfa->prog;
+    const uint8_t *page = editor.page;
+    int32_t state = *s;
+    int64_t match = -1;
+
+    if (dfa->states[state].flags & DFA_MATCH) {
+        if (!longest) {
+            return to;
+        }
+        match = to;
+    }
+
+    for (int64_t i = to; i > from; ) {
+        if (prog->pre.len && (state == DFA_START || state == DFA_START_BOL)) {
+            // candidate ends are (from, i]
+            int64_t lo = from - (int64_t) prog->pre.len + 1;
+            if (lo < limit) {
+                lo = limit;
+            }
+
+            const uint8_t *q = scan.rpmem(page + lo, i - lo, &prog->pre);
+            if (!q || q - page + (int64_t) prog->pre.len <= from) {
+                *s = page[from] == '\n' ? DFA_START_BOL : DFA_START;
+                return match;
+            }
+
+            const int64_t end = q - page + prog->pre.len;
+            if (end < i) {
+                i = end;
+                state = page[i] == '\n' ? DFA_START_BOL : DFA_START;
+            }
+        }
+
+        state = qe_dfa_next(dfa, state, page[--i]);
+
+        const uint8_t flags = dfa->states[state].flags;
+        if (flags & DFA_MATCH) {
+            match = flags & DFA_BEFORE ? i + 1 : i;
+            if (!longest) {
+                break;
+            }
+        }
+
+        if (state == DFA_DEAD || state == DFA_MATCHED) {
+            break;
+        }
+    }
+
+    *s = state;
+    return match;
+}
+
+// Whether `offset` is at the start of a line.
+static inline int qe_regex_bol(int64_t offset)
+{
+    return offset == 0 || editor.page[offset - 1] == '\n';
+}
+
+// Whether `offset` is at the end of a line.
+static inline int qe_regex_eol(int64_t offset)
+{
+    return offset == qe_file_size() || editor.page[offset] == '\n';
+}
+
+// Lazy DFAs for each program of a regular expression, used by one worker at
+// a time.
+struct qe_matcher {
+    struct qe_dfa find;
+    struct qe_dfa end;
+    struct qe_dfa rfind;
+
+    struct qe_matcher *next;
+};
+
+static struct qe_matcher *qe_matcher_create(const struct qe_regex *re, int reverse)
+{
+    struct qe_matcher *m = calloc(1, sizeof(*m));
+    if (m == NULL) {
+        fatal("failed to allocate pattern state");
+    }
+
+    // forward matches are placed by scanning their line backward
+    qe_dfa_init(&m->rfind, &re->rfind);
+    if (!reverse) {
+        qe_dfa_init(&m->find, &re->find);
+        qe_dfa_init(&m->end, &re->end);
+    }
+    return m;
+}
+
+static void qe_matcher_free(struct qe_matcher *m)
+{
+    qe_dfa_free(&m->rfind);
+    if (m->find.prog) {
+        qe_dfa_free(&m->find);
+        qe_dfa_free(&m->end);
+    }
+    free(m);
+}
+
+// Take a matcher from `list`, creating one if it is empty. Matchers are kept
+// between chunks so their DFAs stay warm. `list` is guarded by pool.lock.
+static struct qe_matcher *qe_matcher_get(struct qe_matcher **list, const struct qe_regex *re, int reverse)
+{
+    pthread_mutex_lock(&pool.lock);
+    struct qe_matcher *m = *list;
+    if (m) {
+        *list = m->next;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return m ? m : qe_matcher_create(re, reverse);
+}
+
+static void qe_matcher_put(struct qe_matcher **list, struct qe_matcher *m)
+{
+    pthread_mutex_lock(&pool.lock);
+    m->next = *list;
+    *list = m;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Free every matcher in `list` once no worker can use them.
+static void qe_matcher_free_all(struct qe_matcher **list)
+{
+    while (*list) {
+        struct qe_matcher *m = *list;
+        *list = m->next;
+        qe_matcher_free(m);
+    }
+}
+
+// Return the start of the leftmost match starting at or after `from`, where
+// `end` is where the first match to end scanning forward from `from` ends. The
+// line is read no further than `limit`.
+//
+// The leftmost match need not be the first to end, as for ab+cd|c on "abbcd",
+// but it is on the same line. That line is scanned backward from its end, and
+// the last position a match is seen to start at is the leftmost.
+static int64_t qe_matcher_leftmost(struct qe_matcher *m, int64_t from, int64_t end, int64_t limit)
+{
+    int64_t n = 1;
+    const uint8_t *p = scan.rnth(editor.page + from, end - from, '\n', &n);
+    const int64_t begin = p ? p - editor.page + 1 : from;
+    p = qe_memchr(editor.page + end, '\n', limit - end);
+    const int64_t to = p ? p - editor.page : limit;
+
+    int32_t s = qe_regex_eol(to) ? DFA_START_BOL : DFA_START;
+    int64_t match = qe_dfa_backward(&m->rfind, begin, to, begin, &s, 1);
+    if (s != DFA_DEAD && s != DFA_MATCHED && qe_dfa_eol(&m->rfind, s) && qe_regex_bol(begin)) {
+        match = begin;
+    }
+
+    return match != -1 ? match : end;
+}
+
+// Return where the longest match starting at `start` ends, reading no further
+// than `limit`, or -1 if no match starts there.
+static int64_t qe_matcher_end(struct qe_matcher *m, int64_t start, int64_t limit)
+{
+    int32_t s = qe_regex_bol(start) ? DFA_START_BOL : DFA_START;
+    int64_t end = qe_dfa_forward(&m->end, start, limit, limit, &s, 1);
+    if (s != DFA_DEAD && s != DFA_MATCHED && qe_dfa_eol(&m->end, s) && qe_regex_eol(limit)) {
+        end = limit;
+    }
+    return end;
+}
+
+// Size of the range scanned by each search chunk.
+#define QE_SEARCH_CHUNK (8 << 20)
+
+// Chunks are scanned in steps of this size, checking for cancellation and
+// reporting progress in between.
+#define QE_SEARCH_STEP (1 << 20)
+
+// Search result of a chunk that has not completed yet.
+#define QE_SEARCH_PENDING -2
+
+// Range of match starts an incremental search scans nearest its origin
+// before widening to the rest of the file.
+#define QE_SEARCH_WINDOW (1 << 20)
+
+// A parallel search for the search term.
+//
+// The range of possible match starts [begin, end) is split into chunks. Each
+// chunk also scans the search length - 1 bytes past its end so matches
+// straddling a boundary are found by the chunk they start in.
+//
+// A reverse search numbers its chunks from the end of the range, so in both
+// directions the chunk with the lowest index holds the nearest match.
+//
+// A regular expression search instead scans whole lines, since a match may be
+// arbitrarily long but never spans a line. Each chunk scans the lines which
+// start in it, and the line the search starts in belongs to the first chunk.
+//
+// Searches run in the background while the main loop keeps handling input.
+// Each completed chunk wakes the main loop to check whether the earliest match
+// is known yet.
+struct qe_search {
+    struct qe_job job;
+
+    int64_t begin;
+    int64_t end;
+    int reverse;
+
+    // Search term, copied so the job does not depend on the search buffer.
+    uint8_t term[64];
+    size_t len;
+
+    // Compiled term if it is a regular expression or ignores case, else
+    // NULL. Owned by the editor, which keeps it until the search is stopped.
+    const struct qe_regex *regex;
+
+    // Length of every match, or 0 if the regular expression is run.
+    size_t width;
+
+    // Matchers not in use by any worker. Guarded by pool.lock.
+    struct qe_matcher *matchers;
+
+    // First match in each chunk, -1 if none, or QE_SEARCH_PENDING. Guarded
+    // by pool.lock once the chunk has completed.
+    int64_t *results;
+
+    // Chunks before this are known to contain no match.
+    int64_t resolved;
+
+    // Lowest chunk known to contain a match. Later chunks cannot contain the
+    // earliest match so are skipped.
+    int64_t first;
+
+    // Bytes scanned so far, for progress.
+    int64_t scanned;
+
+    // Time the search started.
+    int64_t started;
+
+    // Range searched next if there is no match in [begin, end), or empty.
+    int64_t rest_begin;
+    int64_t rest_end;
+
+    // Set if searching the term still being typed.
+    int incremental;
+};
+
+// Whether `chunk` should keep scanning.
+static inline int qe_search_live(struct qe_search *search, int64_t chunk)
+{
+    return chunk <= __atomic_load_n(&search->first, __ATOMIC_RELAXED) &&
+           !__atomic_load_n(&search->job.cancel, __ATOMIC_RELAXED);
+}
+
+// Record that `chunk` contains a match, so later chunks can stop.
+static void qe_search_found(struct qe_search *search, int64_t chunk)
+{
+    int64_t first = __atomic_load_n(&search->first, __ATOMIC_RELAXED);
+    while (chunk < first &&
+            !__atomic_compare_exchange_n(&search->first, &first, chunk, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Return the length of the shortest match of `term`, or 0 if it is a regular
+// expression run as a DFA. A regular expression of fixed byte sets, or of
+// alternative literals, is found by where its matches start like a literal.
+static inline size_t qe_term_width(size_t len, const struct qe_regex *regex)
+{
+    if (regex == NULL) {
+        return len;
+    }
+    if (regex->terms) {
+        return regex->terms->shortest;
+    }
+    return regex->pattern ? regex->pattern->len : 0;
+}
+
+// Return the length of the longest match of a term qe_term_width is set for.
+static inline size_t qe_term_longest(size_t len, const struct qe_regex *regex)
+{
+    return regex && regex->terms ? regex->terms->longest : qe_term_width(len, regex);
+}
+
+// Find the first match start of a term qe_term_width is set for in the `n`
+// bytes at `p`, or the last if `reverse`. Matches may run on past them to the
+// end of the file.
+static inline const uint8_t *qe_term_find(const uint8_t *p, size_t n, const uint8_t *term, size_t len,
+                                          const struct qe_regex *regex, int reverse)
+{
+    const size_t rest = editor.page + qe_file_size() - p;
+    size_t avail = n + qe_term_longest(len, regex) - 1;
+    if (avail > rest) {
+        avail = rest;
+    }
+
+    if (regex && regex->terms) {
+        return reverse ? scan.rtmem(p, n, avail, regex->terms) : scan.tmem(p, n, avail, regex->terms);
+    }
+    if (regex) {
+        return reverse ? scan.rpmem(p, avail, regex->pattern) : scan.pmem(p, avail, regex->pattern);
+    }
+    return reverse ? scan.rmem(p, avail, term, len) : scan.mem(p, avail, term, len);
+}
+
+// Return how a search term is described in the status line.
+static const char *qe_term_label(const struct qe_regex *regex)
+{
+    if (regex == NULL) {
+        return "";
+    }
+    if (regex->hex) {
+        return "hex ";
+    }
+    if (regex->literal) {
+        return "icase ";
+    }
+    return regex->fold ? "icase regex " : "regex ";
+}
+
+// Scan the chunk covering match starts [begin, end) for the search term.
+static int64_t qe_search_literal(struct qe_search *search, int64_t chunk, int64_t begin, int64_t end)
+{
+    for (int64_t done = 0; done < end - begin; done += QE_SEARCH_STEP) {
+        if (!qe_search_live(search, chunk)) {
+            break;
+        }
+
+        int64_t n = end - begin - done;
+        if (n > QE_SEARCH_STEP) {
+            n = QE_SEARCH_STEP;
+        }
+
+        // scan steps outward from the search origin
+        const int64_t step = search->reverse ? end - done - n : begin + done;
+        const uint8_t *p = qe_term_find(editor.page + step, n, search->term, search->len,
+                                        search->regex, search->reverse);
+
+        __atomic_fetch_add(&search->scanned, n, __ATOMIC_RELAXED);
+        if (p) {
+            qe_search_found(search, chunk);
+            return p - editor.page;
+        }
+    }
+
+    return -1;
+}
+
+// Narrow the chunk [*begin, *end) of the range [lo, hi) to the lines which
+// start in it, ending with the last of them in full. The start of the first
+// line is only looked for within the chunk, so a line spanning many chunks is
+// scanned once, by the chunk it starts in. Returns 0 if no line starts in the
+// chunk.
+static int qe_chunk_lines(int64_t lo, int64_t hi, int64_t *begin, int64_t *end)
+{
+    if (*begin != lo) {
+        const uint8_t *p = qe_memchr(editor.page + *begin - 1, '\n', *end - *begin);
+        if (p == NULL) {
+            return 0;
+        }
+        *begin = p - editor.page + 1;
+    }
+
+    if (*end != hi) {
+        *end = qe_line_next(*end - 1);
+        if (*end > hi) {
+            *end = hi;
+        }
+    }
+    return *begin < *end;
+}
+
+// Scan the lines starting in the chunk [begin, end) for the regular
+// expression.
+//
+// A forward search finds where the first match ends, then scans back from
+// there to where it starts. A reverse search finds the last match start
+// directly.
+static int64_t qe_search_regex(struct qe_search *search, int64_t chunk, int64_t begin, int64_t end)
+{
+    if (!qe_chunk_lines(search->begin, search->end, &begin, &end)) {
+        return -1;
+    }
+
+    struct qe_matcher *m = qe_matcher_get(&search->matchers, search->regex, search->reverse);
+
+    int64_t result = -1;
+    if (!search->reverse) {
+        int32_t s = qe_regex_bol(begin) ? DFA_START_BOL : DFA_START;
+        for (int64_t from = begin; from < end && qe_search_live(search, chunk); from += QE_SEARCH_STEP) {
+            const int64_t to = end - from > QE_SEARCH_STEP ? from + QE_SEARCH_STEP : end;
+
+            int64_t match = qe_dfa_forward(&m->find, from, to, end, &s, 0);
+            if (match == -1 && to == end && qe_dfa_eol(&m->find, s) && qe_regex_eol(end)) {
+                match = end;
+            }
+
+            __atomic_fetch_add(&search->scanned, to - from, __ATOMIC_RELAXED);
+            if (match != -1) {
+                result = qe_matcher_leftmost(m, begin, match, qe_file_size());
+                break;
+            }
+        }
+    } else {
+        int64_t to = end;
+        int32_t s = qe_regex_eol(to) ? DFA_START_BOL : DFA_START;
+
+        // A match must start before the search origin but may end after it,
+        // so the rest of its line and the byte before it are stepped over by
+        // hand, dropping matches that start at or after the origin.
+        if (to == search->end) {
+            const int64_t size = qe_file_size();
+            const uint8_t *p = qe_memchr(editor.page + to, '\n', size - to);
+            int64_t i = p ? p - editor.page : size;
+            s = qe_regex_eol(i) ? DFA_START_BOL : DFA_START;
+            while (i > to - 1) {
+                s = qe_dfa_next(&m->rfind, s, editor.page[--i]);
+            }
+            to -= 1;
+            if (s == DFA_MATCHED) {
+                s = DFA_START_BOL;
+            }
+        }
+
+        // the last step runs even if empty, to check for a match at <begin>
+        while (qe_search_live(search, chunk)) {
+            const int64_t from = to - begin > QE_SEARCH_STEP ? to - QE_SEARCH_STEP : begin;
+
+            result = qe_dfa_backward(&m->rfind, from, to, begin, &s, 0);
+            if (result == -1 && from == begin && qe_dfa_eol(&m->rfind, s) && qe_regex_bol(begin)) {
+                result = begin;
+            }
+
+            __atomic_fetch_add(&search->scanned, to - from, __ATOMIC_RELAXED);
+            if (result != -1 || from == begin) {
+                break;
+            }
+            to = from;
+        }
+    }
+
+    if (result != -1) {
+        qe_search_found(search, chunk);
+    }
+
+    qe_matcher_put(&search->matchers, m);
+    return result;
+}
+
+static void qe_search_run(struct qe_job *job, int64_t chunk)
+{
+    struct qe_search *search = (struct qe_search *) job;
+
+    int64_t begin, end;
+    if (!search->reverse) {
+        begin = search->begin + chunk * QE_SEARCH_CHUNK;
+        end = begin + QE_SEARCH_CHUNK;
+        if (end > search->end) {
+            end = search->end;
+        }
+    } else {
+        end = search->end - chunk * QE_SEARCH_CHUNK;
+        begin = end - QE_SEARCH_CHUNK;
+        if (begin < search->begin) {
+            begin = search->begin;
+        }
+    }
+
+    const int64_t result = search->width
+        ? qe_search_literal(search, chunk, begin, end)
+        : qe_search_regex(search, chunk, begin, end);
+
+    pthread_mutex_lock(&pool.lock);
+    search->results[chunk] = result;
+    pthread_mutex_unlock(&pool.lock);
+
+    qe_loop_wake();
+}
+
+// Stop the background search and release it.
+static void qe_search_stop(void)
+{
+    struct qe_search *search = editor.search;
+    if (search == NULL) {
+        return;
+    }
+
+    // Running chunks notice the cancel within a step.
+    qe_job_cancel(&search->job);
+    qe_job_wait(&search->job);
+
+    qe_matcher_free_all(&search->matchers);
+
+    free(search->results);
+    free(search);
+    editor.search = NULL;
+}
+
+// Allocate a search for the match starts [begin, end) of `term`. The search
+// is not started.
+static struct qe_search *qe_search_create(const uint8_t *term, size_t len, const struct qe_regex *regex,
+                                          int64_t begin, int64_t end, int reverse)
+{
+    struct qe_search *search = calloc(1, sizeof(*search));
+    if (search == NULL) {
+        fatal("failed to allocate search");
+    }
+
+    search->begin = begin;
+    search->end = end;
+    search->reverse = reverse;
+    memcpy(search->term, term, len);
+    search->len = len;
+    search->regex = regex;
+    search->width = qe_term_width(len, regex);
+    search->first = INT64_MAX;
+    search->started = qe_now_ns();
+
+    search->job.run = qe_search_run;
+    search->job.chunks = (search->end - search->begin + QE_SEARCH_CHUNK - 1) / QE_SEARCH_CHUNK;
+    search->results = malloc(search->job.chunks * sizeof(int64_t));
+    if (search->results == NULL) {
+        fatal("failed to allocate search");
+    }
+    for (int64_t i = 0; i < search->job.chunks; ++i) {
+        search->results[i] = QE_SEARCH_PENDING;
+    }
+
+    return search;
+}
+
+// Start searching in the background for `term` from byte offset. A forward
+// search finds matches starting after `offset`, a reverse search the nearest
+// match starting before it. Any search already running is stopped.
+//
+// An incremental search first scans only the window nearest `offset`, so a
+// close match is found without waiting on the rest of the file.
+//
+// Returns 0 if there is nothing to search.
+static int qe_search_launch(const uint8_t *term, size_t len, const struct qe_regex *regex,
+                            int64_t offset, int reverse, int incremental)
+{
+    qe_search_stop();
+
+    const int64_t size = editor.file.st_size;
+    int64_t begin = reverse ? 0 : offset + 1;
+
+    // a regular expression match may be shorter than the term
+    const size_t width = qe_term_width(len, regex);
+    int64_t end = width ? size - (int64_t) width + 1 : size;
+    if (reverse && offset < end) {
+        end = offset;
+    }
+
+    if (len == 0 || begin >= end) {
+        return 0;
+    }
+
+    // Regular expression matches do not cross lines, so the window is split
+    // at a line start to keep matches whole on one side.
+    int64_t rest_begin = 0;
+    int64_t rest_end = 0;
+    if (incremental && end - begin > QE_SEARCH_WINDOW) {
+        if (!reverse) {
+            int64_t split = begin + QE_SEARCH_WINDOW;
+            if (!width) {
+                split = qe_line_next(split - 1);
+            }
+            if (split < end) {
+                rest_begin = split;
+                rest_end = end;
+                end = split;
+            }
+        } else {
+            int64_t split = end - QE_SEARCH_WINDOW;
+            if (!width) {
+                split = qe_line_start(split);
+            }
+            if (split > begin) {
+                rest_begin = begin;
+                rest_end = split;
+                begin = split;
+            }
+        }
+    }
+
+    struct qe_search *search = qe_search_create(term, len, regex, begin, end, reverse);
+    search->rest_begin = rest_begin;
+    search->rest_end = rest_end;
+    search->incremental = incremental;
+
+    editor.search = search;
+    qe_job_submit(&search->job);
+    return 1;
+}
+
+// Start searching in the background for the last committed search term from
+// byte offset.
+static int qe_search_start(int64_t offset, int reverse)
+{
+    return qe_search_launch((const uint8_t *) editor.search_term, editor.search_term_len,
+                            editor.search_term_regex, offset, reverse, 0);
+}
+
+// Return the earliest match of the background search, -1 if there is none,
+// or QE_SEARCH_PENDING if chunks before the earliest match are still running.
+static int64_t qe_search_result(struct qe_search *search)
+{
+    int64_t match = -1;
+
+    pthread_mutex_lock(&pool.lock);
+    for (; search->resolved < search->job.chunks; ++search->resolved) {
+        match = search->results[search->resolved];
+        if (match != -1) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return match;
+}
+
+// Show the progress of the background search in the status line.
+static void qe_search_status(void)
+{
+    const struct qe_search *search = editor.search;
+
+    const int64_t scanned = __atomic_load_n(&search->scanned, __ATOMIC_RELAXED);
+    const int64_t total = search->end - search->begin;
+    const double elapsed = (qe_now_ns() - search->started) / 1e9;
+
+    char done[16], rate[16];
+    qe_format_size(done, sizeof(done), scanned);
+    qe_format_size(rate, sizeof(rate), elapsed > 0 ? scanned / elapsed : 0);
+
+    // regular expression chunks may scan past their range to a line end
+    snprintf(editor.status_buffer, sizeof(editor.status_buffer),
+             "searching %s%c%.*s: %s, %s/s, %3"PRId64"%% (ESC to abort)",
+             qe_term_label(search->regex), search->reverse ? '?' : '/',
+             (int) search->len, search->term, done, rate,
+             total && scanned < total ? 100 * scanned / total : 100);
+}
+
+// Refresh search progress in the status line until the search completes.
+static void qe_search_progress(void)
+{
+    if (editor.search == NULL) {
+        return;
+    }
+
+    if (!qe_prompt_open(editor.mode)) {
+        qe_search_status();
+        editor.dirty = 1;
+    }
+    qe_loop_defer(qe_search_progress, QE_PROGRESS_MS);
+}
+
+// Show the search being typed in the status line.
+static void qe_search_prompt(void)
+{
+    snprintf(editor.status_buffer, sizeof(editor.status_buffer), "%s%s%s%c%s",
+             editor.search_fold && !editor.search_hex ? "icase " : "",
+             editor.search_regex && !editor.search_hex ? "regex " : "",
+             editor.search_hex ? "hex " : "", editor.search_reverse ? '?' : '/', editor.search_buf);
+    editor.dirty = 1;
+}
+
+// Report that the last committed search term has no match.
+static void qe_search_not_found(void)
+{
+    qe_update_status_buffer();
+    snprintf(editor.status_buffer, sizeof(editor.status_buffer),
+             "Pattern not found: %.*s", (int) editor.search_term_len, editor.search_term);
+    editor.status_message = 1;
+    editor.dirty = 1;
+}
+
+// Return the view and cursor to where they were when the search prompt was
+// opened.
+static void qe_search_restore(void)
+{
+    editor.page_offset = editor.search_origin.page_offset;
+    editor.page_offset_x = editor.search_origin.page_offset_x;
+    editor.cursor_x = editor.search_origin.cursor_x;
+    editor.cursor_y = editor.search_origin.cursor_y;
+    editor.dirty_cursor = 1;
+
+    qe_update_status_buffer();
+    editor.dirty = 1;
+}
+
+// Move the view and cursor to a match at byte offset `match`.
+static void qe_search_jump(int64_t match)
+{
+    const int64_t size = qe_row_size();
+    if (size) {
+        editor.page_offset = match - match % size;
+        qe_row_show(match);
+        editor.dirty = 1;
+        return;
+    }
+
+    // Go to the start of the line where the entry occurred.
+    int64_t addr = qe_line_start(match);
+
+    // TODO: Shift the page_offset_x in one computation directly.
+    // based on terminal width.
+    editor.page_offset = addr;
+
+    // TODO: Round page_offset_x to editor terminal size and
+    // set cursor based on this.
+    editor.page_offset_x = match - addr;
+
+    // the cursor sits on the match so n/N continue from it
+    editor.cursor_x = 0;
+    editor.cursor_y = 0;
+    editor.dirty_cursor = 1;
+
+    qe_update_status_buffer();
+    editor.dirty = 1;
+}
+
+// Jump to the background search result once it is known.
+static void qe_search_poll(void)
+{
+    if (editor.search == NULL) {
+        return;
+    }
+
+    struct qe_search *search = editor.search;
+    const int64_t match = qe_search_result(search);
+    if (match == QE_SEARCH_PENDING) {
+        return;
+    }
+
+    // nothing near the origin, widen to the rest of the file
+    if (match == -1 && search->rest_begin < search->rest_end) {
+        struct qe_search *rest = qe_search_create(search->term, search->len, search->regex,
+                                                  search->rest_begin, search->rest_end,
+                                                  search->reverse);
+        rest->incremental = search->incremental;
+
+        qe_search_stop();
+        editor.search = rest;
+        qe_job_submit(&rest->job);
+        return;
+    }
+
+    const int incremental = search->incremental;
+    qe_search_stop();
+
+    // the view follows the term being typed, and returns if it is not found
+    if (incremental) {
+        editor.search_buf_match = match;
+        if (match == -1) {
+            qe_search_restore();
+        } else {
+            qe_search_jump(match);
+        }
+        qe_search_prompt();
+        return;
+    }
+
+    if (match == -1) {
+        qe_search_not_found();
+        return;
+    }
+
+    qe_search_jump(match);
+}
+
+// Maximum number of matches the match index records. Beyond this only the
+// count so far is shown and n/N fall back to searching.
+#define QE_MATCHES_MAX (1 << 24)
+
+// Matches found in one chunk of the match index, as offsets from <base> so
+// each costs four bytes.
+struct qe_match_chunk {
+    int64_t base;
+    uint32_t *offsets;
+    int64_t count;
+    int64_t cap;
+};
+
+// Sorted offsets of every match of the last committed search term.
+//
+// Built in the background on the worker pool once a search is committed. The
+// matches are the positions n would stop at one after another from the start
+// of the file, so overlapping matches are all included. Each chunk of the file
+// collects its own matches, and since chunks are in file order the index is
+// sorted without merging. Once complete, n/N and the "match k of N" status are
+// binary searches.
+//
+// The index is dropped when the file is edited.
+struct qe_matches {
+    struct qe_job job;
+
+    uint8_t term[64];
+    size_t len;
+    const struct qe_regex *regex;
+    size_t width;
+
+    // Matchers not in use by any worker. Guarded by pool.lock.
+    struct qe_matcher *matchers;
+
+    // Range of match starts [0, end).
+    int64_t end;
+
+    struct qe_match_chunk *chunks;
+
+    // Matches before each chunk. Only set once complete.
+    int64_t *prefix;
+
+    // Matches found so far, for progress.
+    int64_t found;
+
+    // Set if a limit was hit, the index is then incomplete.
+    int overflow;
+
+    // Set on the main thread once every chunk has completed.
+    int complete;
+};
+
+// Record a match at `offset` in chunk `c`. Returns 0 if the index is full.
+static int qe_matches_push(struct qe_matches *mi, struct qe_match_chunk *c, int64_t offset)
+{
+    if (offset - c->base > UINT32_MAX ||
+            __atomic_fetch_add(&mi->found, 1, __ATOMIC_RELAXED) >= QE_MATCHES_MAX) {
+        __atomic_store_n(&mi->overflow, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (c->count == c->cap) {
+        const int64_t cap = c->cap ? 2 * c->cap : 256;
+        uint32_t *offsets = realloc(c->offsets, cap * sizeof(uint32_t));
+        if (offsets == NULL) {
+            fatal("failed to allocate match index");
+        }
+        c->offsets = offsets;
+        c->cap = cap;
+    }
+
+    c->offsets[c->count++] = offset - c->base;
+    return 1;
+}
+
+static inline int qe_matches_live(struct qe_matches *mi)
+{
+    return !__atomic_load_n(&mi->job.cancel, __ATOMIC_RELAXED) &&
+           !__atomic_load_n(&mi->overflow, __ATOMIC_RELAXED);
+}
+
+static void qe_matches_literal(struct qe_matches *mi, struct qe_match_chunk *c, int64_t begin, int64_t end)
+{
+    for (int64_t p = begin; p < end && qe_matches_live(mi); ) {
+        const int64_t to = end - p > QE_SEARCH_STEP ? p + QE_SEARCH_STEP : end;
+        const uint8_t *q = qe_term_find(editor.page + p, to - p, mi->term, mi->len, mi->regex, 0);
+        if (!q) {
+            p = to;
+        } else if (qe_matches_push(mi, c, q - editor.page)) {
+            p = q - editor.page + 1;
+        }
+    }
+}
+
+// Record every start of a match on the line [begin, to), in file order.
+// Returns 0 if the index is full.
+//
+// The line is scanned backward once, and a match starts wherever the reverse
+// dfa is in a matching state. Starts are found last first, so they are
+// reversed once the line is done.
+static int qe_matches_line(struct qe_matches *mi, struct qe_match_chunk *c, struct qe_matcher *m,
+                           int64_t begin, int64_t to)
+{
+    const int64_t first = c->count;
+    int ok = 1;
+
+    int32_t s = qe_regex_eol(to) ? DFA_START_BOL : DFA_START;
+    for (int64_t i = to; ok; ) {
+        const int64_t match = qe_dfa_backward(&m->rfind, begin, i, begin, &s, 0);
+        if (match == -1) {
+            if (s != DFA_DEAD && s != DFA_MATCHED && qe_dfa_eol(&m->rfind, s) && qe_regex_bol(begin)) {
+                ok = qe_matches_push(mi, c, begin);
+            }
+            break;
+        }
+
+        ok = qe_matches_push(mi, c, match);
+        if (match == begin) {
+            break;
+        }
+
+        // step past the start just recorded
+        i = match - 1;
+        s = qe_dfa_next(&m->rfind, s, editor.page[i]);
+    }
+
+    for (int64_t a = first, b = c->count - 1; a < b; ++a, --b) {
+        const uint32_t t = c->offsets[a];
+        c->offsets[a] = c->offsets[b];
+        c->offsets[b] = t;
+    }
+    return ok;
+}
+
+// Matches of a regular expression are every position a match starts at, as
+// repeated forward searches would find them. Lines without a match are
+// skipped by the forward dfa, and each line with one is then scanned for all
+// of its starts.
+static void qe_matches_regex(struct qe_matches *mi, struct qe_match_chunk *c, int64_t begin, int64_t end)
+{
+    struct qe_matcher *m = qe_matcher_get(&mi->matchers, mi->regex, 0);
+
+    int32_t s = qe_regex_bol(begin) ? DFA_START_BOL : DFA_START;
+    for (int64_t from = begin; from < end && qe_matches_live(mi); ) {
+        const int64_t to = end - from > QE_SEARCH_STEP ? from + QE_SEARCH_STEP : end;
+
+        int64_t match = qe_dfa_forward(&m->find, from, to, end, &s, 0);
+        if (match == -1 && to == end && qe_dfa_eol(&m->find, s) && qe_regex_eol(end)) {
+            match = end;
+        }
+
+        if (match == -1) {
+            from = to;
+            continue;
+        }
+
+        int64_t n = 1;
+        const uint8_t *p = scan.rnth(editor.page + begin, match - begin, '\n', &n);
+        const int64_t line = p ? p - editor.page + 1 : begin;
+        p = qe_memchr(editor.page + match, '\n', mi->end - match);
+        const int64_t line_end = p ? p - editor.page : mi->end;
+        if (!qe_matches_line(mi, c, m, line, line_end)) {
+            break;
+        }
+
+        // lines before the next one have been scanned
+        begin = from = line_end + 1;
+        s = DFA_START_BOL;
+    }
+
+    qe_matcher_put(&mi->matchers, m);
+}
+
+// The last chunk wakes the loop before the job is marked finished, so wake it
+// again to complete the index.
+static void qe_matches_finish(struct qe_job *job)
+{
+    (void) job;
+    qe_loop_wake();
+}
+
+static void qe_matches_run(struct qe_job *job, int64_t chunk)
+{
+    struct qe_matches *mi = (struct qe_matches *) job;
+    struct qe_match_chunk *c = &mi->chunks[chunk];
+
+    int64_t begin = chunk * QE_SEARCH_CHUNK;
+    int64_t end = begin + QE_SEARCH_CHUNK;
+    if (end > mi->end) {
+        end = mi->end;
+    }
+
+    // as for searches, regular expression chunks own the lines starting in them
+    if (!mi->width && !qe_chunk_lines(0, mi->end, &begin, &end)) {
+        begin = end;
+    }
+
+    c->base = begin;
+    if (mi->width) {
+        qe_matches_literal(mi, c, begin, end);
+    } else {
+        qe_matches_regex(mi, c, begin, end);
+    }
+
+    qe_loop_wake();
+}
+
+// Stop building the match index and release it.
+static void qe_matches_stop(void)
+{
+    struct qe_matches *mi = editor.matches;
+    if (mi == NULL) {
+        return;
+    }
+
+    qe_job_cancel(&mi->job);
+    qe_job_wait(&mi->job);
+
+    qe_matcher_free_all(&mi->matchers);
+    for (int64_t i = 0; i < mi->job.chunks; ++i) {
+        free(mi->chunks[i].offsets);
+    }
+    free(mi->chunks);
+    free(mi->prefix);
+    free(mi);
+    editor.matches = NULL;
+}
+
+// Start building the match index for the last committed search term,
+// replacing any previous index.
+static void qe_matches_start(void)
+{
+    qe_matches_stop();
+
+    const int64_t size = editor.file.st_size;
+    const int64_t len = editor.search_term_len;
+    const int64_t width = qe_term_width(len, editor.search_term_regex);
+    const int64_t end = width ? size - width + 1 : size;
+    if (len == 0 || end <= 0) {
+        return;
+    }
+
+    struct qe_matches *mi = calloc(1, sizeof(*mi));
+    if (mi == NULL) {
+        fatal("failed to allocate match index");
+    }
+
+    memcpy(mi->term, editor.search_term, len);
+    mi->len = len;
+    mi->regex = editor.search_term_regex;
+    mi->width = width;
+    mi->end = end;
+
+    mi->job.run = qe_matches_run;
+    mi->job.finish = qe_matches_finish;
+    mi->job.chunks = (end + QE_SEARCH_CHUNK - 1) / QE_SEARCH_CHUNK;
+    mi->chunks = calloc(mi->job.chunks, sizeof(struct qe_match_chunk));
+    if (mi->chunks == NULL) {
+        fatal("failed to allocate match index");
+    }
+
+    editor.matches = mi;
+    qe_job_submit(&mi->job);
+}
+
+// Complete the match index once every chunk has finished. Returns whether it
+// is complete and usable for lookups.
+static int qe_matches_poll(void)
+{
+    struct qe_matches *mi = editor.matches;
+    if (mi == NULL || mi->overflow) {
+        return 0;
+    }
+    if (mi->complete) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    const int finished = mi->job.finished;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!finished || mi->overflow) {
+        return 0;
+    }
+
+    mi->prefix = malloc(mi->job.chunks * sizeof(int64_t));
+    if (mi->prefix == NULL) {
+        fatal("failed to allocate match index");
+    }
+
+    int64_t n = 0;
+    for (int64_t i = 0; i < mi->job.chunks; ++i) {
+        mi->prefix[i] = n;
+        n += mi->chunks[i].count;
+    }
+
+    mi->found = n;
+    mi->complete = 1;
+    return 1;
+}
+
+// Return the number of matches starting before `offset`. The index must be
+// complete.
+static int64_t qe_matches_rank(const struct qe_matches *mi, int64_t offset)
+{
+    // last chunk based at or before offset
+    int64_t lo = 0;
+    int64_t hi = mi->job.chunks;
+    while (hi - lo > 1) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (mi->chunks[mid].base <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // a line's matches are all in the chunk it starts in, so the chunks it
+    // runs on through are empty
+    while (lo > 0 && mi->chunks[lo].count == 0) {
+        lo--;
+    }
+
+    const struct qe_match_chunk *c = &mi->chunks[lo];
+    if (offset <= c->base) {
+        return mi->prefix[lo];
+    }
+
+    const uint64_t rel = offset - c->base;
+    int64_t l = 0;
+    int64_t h = c->count;
+    while (l < h) {
+        const int64_t mid = l + (h - l) / 2;
+        if (c->offsets[mid] < rel) {
+            l = mid + 1;
+        } else {
+            h = mid;
+        }
+    }
+
+    return mi->prefix[lo] + l;
+}
+
+// Return the offset of match `k` (0-based). The index must be complete.
+//
+// The last chunk with at most `k` matches before it holds match `k`.
+static int64_t qe_matches_at(const struct qe_matches *mi, int64_t k)
+{
+    int64_t lo = 0;
+    int64_t hi = mi->job.chunks;
+    while (hi - lo > 1) {
+        const int64_t mid = lo + (hi - lo) / 2;
+        if (mi->prefix[mid] <= k) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return mi->chunks[lo].base + mi->chunks[lo].offsets[k - mi->prefix[lo]];
+}
+
+// Format the match count, and which match the cursor is on, for the status
+// line.
+static int qe_matches_status(char *buf, size_t n)
+{
+    const struct qe_matches *mi = editor.matches;
+    if (mi == NULL) {
+        return 0;
+    }
+
+    if (!qe_matches_poll()) {
+        int64_t found = __atomic_load_n(&mi->found, __ATOMIC_RELAXED);
+        if (found > QE_MATCHES_MAX) {
+            found = QE_MATCHES_MAX;
+        }
+        return snprintf(buf, n, " [%"PRId64"+ matches]", found);
+    }
+
+    const int64_t offset = qe_get_cursor_byte_position();
+    const int64_t k = qe_matches_rank(mi, offset);
+    if (k < mi->found && qe_matches_at(mi, k) == offset) {
+        return snprintf(buf, n, " [match %"PRId64" of %"PRId64"]", k + 1, mi->found);
+    }
+
+    return snprintf(buf, n, " [%"PRId64" matches]", mi->found);
+}
+
+// Write which term of the last committed multi-term search matches at the
+// cursor to `buf`, if any. Returns the length written.
+static int qe_terms_status(char *buf, size_t n)
+{
+    const struct qe_regex *regex = editor.search_term_regex;
+    if (regex == NULL || regex->terms == NULL) {
+        return 0;
+    }
+
+    const struct qe_terms *t = regex->terms;
+    const int64_t offset = qe_get_cursor_byte_position();
+    if (offset >= editor.file.st_size) {
+        return 0;
+    }
+
+    const int k = qe_terms_at(t, editor.page + offset, editor.file.st_size - offset);
+    if (k == -1) {
+        return 0;
+    }
+    return snprintf(buf, n, " [term %d: %.*s]", k + 1, (int) t->len[k], t->bytes + t->off[k]);
+}
+
+// Matches starting this many bytes before a row are still highlighted on it.
+// Longer matches are only highlighted from where they start.
+#define QE_HIGHLIGHT_CONTEXT 4096
+
+// A highlighted range of file bytes [start, end).
+struct qe_span {
+    int64_t start;
+    int64_t end;
+    uint8_t attr;
+};
+
+// Matches of the search term on screen.
+//
+// Only the bytes shown on each row are scanned, as the rows are drawn. The
+// spans found are kept for later frames until the view or the term changes,
+// so redrawing for the cursor or status line does not scan again.
+static struct {
+    struct qe_span *spans;
+    int count;
+    int cap;
+
+    // Set while the spans are for the view below.
+    int valid;
+    int64_t page_offset;
+    int64_t page_offset_x;
+    int wrap;
+    int hex;
+    int width;
+    int height;
+
+    // Set while the spans are being collected by the frame being drawn.
+    int fill;
+
+    // Matches starting before this offset have been collected.
+    int64_t scanned;
+
+    // First span that may still be on the rows left to draw.
+    int first;
+
+    struct qe_matcher *matcher;
+} highlight;
+
+// Drop the highlighted matches. Must be called when the term changes, before
+// a regular expression it used is freed, or when the file changes.
+static void qe_highlight_reset(void)
+{
+    if (highlight.matcher) {
+        qe_matcher_free(highlight.matcher);
+        highlight.matcher = NULL;
+    }
+    highlight.valid = 0;
+}
+
+// Return the term to highlight: the search being typed while the prompt is
+// open, else the last committed search. Returns 0 if there is none.
+static int qe_highlight_term(const uint8_t **term, size_t *len, const struct qe_regex **regex)
+{
+    if (editor.mode == MODE_SEARCH) {
+        if ((editor.search_regex || editor.search_fold || editor.search_hex) &&
+                editor.search_buf_regex == NULL) {
+            return 0;
+        }
+        *term = (const uint8_t *) editor.search_buf;
+        *len = editor.search_len;
+        *regex = editor.search_buf_regex;
+    } else {
+        *term = (const uint8_t *) editor.search_term;
+        *len = editor.search_term_len;
+        *regex = editor.search_term_regex;
+    }
+    return *len != 0;
+}
+
+// Add a span unless it overlaps the last, so spans end in order.
+static void qe_highlight_push(int64_t start, int64_t end, int attr)
+{
+    if (highlight.count && start < highlight.spans[highlight.count - 1].end) {
+        return;
+    }
+
+    if (highlight.count == highlight.cap) {
+        const int cap = highlight.cap ? 2 * highlight.cap : 64;
+        struct qe_span *spans = realloc(highlight.spans, cap * sizeof(struct qe_span));
+        if (spans == NULL) {
+            fatal("failed to allocate highlight");
+        }
+        highlight.spans = spans;
+        highlight.cap = cap;
+    }
+
+    highlight.spans[highlight.count].start = start;
+    highlight.spans[highlight.count].end = end;
+    highlight.spans[highlight.count].attr = attr;
+    highlight.count += 1;
+}
+
+// Collect the matches starting in [from, to) of a term qe_term_width is set
+// for. Each term of a multi-term search has its own color.
+static void qe_highlight_literal(const uint8_t *term, size_t len, const struct qe_regex *regex,
+                                 int64_t from, int64_t to)
+{
+    const struct qe_terms *terms = regex ? regex->terms : NULL;
+    const size_t width = qe_term_width(len, regex);
+
+    for (int64_t p = from; p < to; ) {
+        const uint8_t *q = qe_term_find(editor.page + p, to - p, term, len, regex, 0);
+        if (!q) {
+            break;
+        }
+
+        p = q - editor.page;
+        if (terms) {
+            const int k = qe_terms_at(terms, q, editor.file.st_size - p);
+            qe_highlight_push(p, p + terms->len[k], ATTR_TERM + k % QE_TERM_COLORS);
+        } else {
+            qe_highlight_push(p, p + width, ATTR_MATCH);
+        }
+        p += 1;
+    }
+}
+
+// Collect the matches of a regular expression starting in [from, to). Matches
+// do not overlap, each search continuing from where the last match ended.
+// Returns where the next search continues from.
+static int64_t qe_highlight_regex(const struct qe_regex *regex, int64_t from, int64_t to)
+{
+    if (highlight.matcher == NULL) {
+        highlight.matcher = qe_matcher_create(regex, 0);
+    }
+    struct qe_matcher *m = highlight.matcher;
+
+    // a match may run on past the row to the end of its line
+    int64_t limit = editor.file.st_size - to > QE_HIGHLIGHT_CONTEXT
+        ? to + QE_HIGHLIGHT_CONTEXT : editor.file.st_size;
+    const uint8_t *nl = qe_memchr(editor.page + to, '\n', limit - to);
+    if (nl) {
+        limit = nl - editor.page;
+    }
+
+    int64_t p = from;
+    while (p < to) {
+        int32_t s = qe_regex_bol(p) ? DFA_START_BOL : DFA_START;
+        int64_t end = qe_dfa_forward(&m->find, p, limit, limit, &s, 0);
+        if (end == -1 && qe_dfa_eol(&m->find, s) && qe_regex_eol(limit)) {
+            end = limit;
+        }
+        if (end == -1) {
+            break;
+        }
+
+        // the leftmost match is shown in full, to its longest end
+        const int64_t start = qe_matcher_leftmost(m, p, end, limit);
+        if (start >= to) {
+            break;
+        }
+        end = qe_matcher_end(m, start, limit);
+
+        if (end > start) {
+            qe_highlight_push(start, end, ATTR_MATCH);
+        }
+        p = end > start ? end : start + 1;
+    }
+
+    return p;
+}
+
+// Start highlighting a frame, reusing the matches of the last frame if the
+// view is unchanged.
+static void qe_highlight_begin(void)
+{
+    if (highlight.valid &&
+            highlight.page_offset == editor.page_offset &&
+            highlight.page_offset_x == editor.page_offset_x &&
+            highlight.wrap == editor.wrap &&
+            highlight.hex == editor.hex &&
+            highlight.width == terminal.width &&
+            highlight.height == terminal.height) {
+        highlight.fill = 0;
+        highlight.first = 0;
+        return;
+    }
+
+    highlight.valid = 1;
+    highlight.page_offset = editor.page_offset;
+    highlight.page_offset_x = editor.page_offset_x;
+    highlight.wrap = editor.wrap;
+    highlight.hex = editor.hex;
+    highlight.width = terminal.width;
+    highlight.height = terminal.height;
+
+    highlight.count = 0;
+    highlight.scanned = 0;
+    highlight.first = 0;
+    highlight.fill = 1;
+}
+
+// Set the attribute of the cells showing byte `i` of a row. In the hex view
+// this is both its hex digits and its ASCII cell, and the gap to the next
+// byte if it is highlighted too.
+static void qe_draw_mark(struct cell *row, int64_t i, int joined, int attr)
+{
+    if (!editor.hex) {
+        row[i].attr = attr;
+        return;
+    }
+
+    const int digits = qe_hex_digits();
+    const int x = qe_hex_column(digits, i);
+    const int n = joined && i != QE_HEX_ROW / 2 - 1 ? 3 : 2;
+    for (int j = x; j < x + n && j < grid.width; ++j) {
+        row[j].attr = attr;
+    }
+
+    const int a = qe_hex_ascii_column(digits, i);
+    if (a < grid.width) {
+        row[a].attr = attr;
+    }
+}
+
+// Highlight the matches on row `y`, which shows the file bytes [from, to)
+// from the first column, or as a hex dump row.
+static void qe_draw_matches(int y, int64_t from, int64_t to)
+{
+    if (highlight.fill) {
+        const uint8_t *term;
+        size_t len;
+        const struct qe_regex *regex;
+        if (qe_highlight_term(&term, &len, &regex)) {
+            // rows are drawn in file order, so only scan what earlier rows
+            // have not
+            const size_t width = qe_term_width(len, regex);
+            const int64_t context = width ? (int64_t) qe_term_longest(len, regex) - 1 : QE_HIGHLIGHT_CONTEXT;
+            int64_t begin = from - context;
+            if (begin < highlight.scanned) {
+                begin = highlight.scanned;
+            }
+
+            if (begin < to) {
+                int64_t next = to;
+                if (width) {
+                    qe_highlight_literal(term, len, regex, begin, to);
+                } else {
+                    next = qe_highlight_regex(regex, begin, to);
+                }
+                highlight.scanned = next > to ? next : to;
+            }
+        }
+    }
+
+    // spans are in order and end in order, as they do not overlap
+    while (highlight.first < highlight.count && highlight.spans[highlight.first].end <= from) {
+        highlight.first += 1;
+    }
+
+    struct cell *row = qe_grid_row(y);
+    for (int i = highlight.first; i < highlight.count; ++i) {
+        const struct qe_span *span = &highlight.spans[i];
+        if (span->start >= to) {
+            break;
+        }
+
+        const int64_t a = span->start > from ? span->start : from;
+        const int64_t b = span->end < to ? span->end : to;
+        for (int64_t off = a; off < b; ++off) {
+            qe_draw_mark(row, off - from, off + 1 < b, span->attr);
+        }
+    }
+}
+
+// Compile the search being typed if it is a regular expression, ignores case
+// or is hex. Returns 0 and sets `error` if the pattern is invalid.
+static int qe_search_compile(struct qe_regex **re, const char **error)
+{
+    const uint8_t *term = (const uint8_t *) editor.search_buf;
+    *re = NULL;
+    if (editor.search_len == 0) {
+        return 1;
+    }
+
+    if (editor.search_hex) {
+        *re = qe_regex_hex(term, editor.search_len, error);
+        return *re != NULL;
+    }
+    if (editor.search_regex) {
+        *re = qe_regex_compile(term, editor.search_len, editor.search_fold, error);
+        return *re != NULL;
+    }
+    if (editor.search_fold) {
+        *re = qe_regex_literal(term, editor.search_len);
+    }
+    return 1;
+}
+
+// Make the search being typed the last committed search, compiling it if it
+// is a regular expression. Returns 0 if the pattern is invalid, the previous
+// search is then kept.
+static int qe_search_commit(void)
+{
+    struct qe_regex *re = editor.search_buf_regex;
+    if (re == NULL) {
+        const char *error;
+        if (!qe_search_compile(&re, &error)) {
+            qe_update_status_buffer();
+            snprintf(editor.status_buffer, sizeof(editor.status_buffer),
+                     "Invalid pattern: %s", error);
+            editor.status_message = 1;
+            editor.dirty = 1;
+            return 0;
+        }
     }
 
-    qe_update_status_buffer();
-    editor.dirty = 1;
+    // The incremental search already runs on the new pattern, but any other
+    // search or the match index may still use the old one.
+    if (editor.search && !editor.search->incremental) {
+        qe_search_stop();
+    }
+    qe_matches_stop();
+    qe_highlight_reset();
+    qe_regex_free(editor.search_term_regex);
+    editor.search_term_regex = re;
+    editor.search_buf_regex = NULL;
+
+    memcpy(editor.search_term, editor.search_buf, editor.search_len);
+    editor.search_term_len = editor.search_len;
+    editor.search_term_reverse = editor.search_reverse;
+    return 1;
 }
 
-// Shift the buffer view left or right.
-//
-// TODO: Stop shifting if we have buffer is empty.
-static void qe_move_window_x(int32_t n)
+// Search for the term being typed from where the prompt was opened, replacing
+// the search for what was typed before. The view jumps to the match once it
+// is found.
+static void qe_search_incremental(void)
 {
-    editor.page_offset_x += n;
-
-    if (editor.page_offset_x < 0) {
-        editor.page_offset_x = 0;
-        qe_update_status_buffer();
+    qe_search_stop();
+    qe_highlight_reset();
+    qe_regex_free(editor.search_buf_regex);
+    editor.search_buf_regex = NULL;
+    editor.search_buf_match = QE_SEARCH_PENDING;
+
+    // a pattern is often incomplete while it is being typed
+    const char *error;
+    if (!qe_search_compile(&editor.search_buf_regex, &error)) {
+        qe_search_restore();
         return;
     }
 
-    qe_update_status_buffer();
-    editor.dirty = 1;
+    if (!qe_search_launch((const uint8_t *) editor.search_buf, editor.search_len,
+                          editor.search_buf_regex, editor.search_origin.offset,
+                          editor.search_reverse, 1)) {
+        if (editor.search_len != 0) {
+            editor.search_buf_match = -1;
+        }
+        qe_search_restore();
+    }
 }
 
-// Return the current byte position offset of the cursor.
-//
-// TODO: This needs to be fast as we use it on every cursor movement to check
-// if are at the end of a line. Cache new-lines to make this faster.
-//
-// TODO: Incorrect on non-first-line.
-static int64_t qe_get_cursor_byte_position(void)
+// Close the search prompt without searching, returning the view to where it
+// was opened.
+static void qe_search_cancel(void)
 {
-    // scan forward past n new lines
-    int64_t offset = editor.page_offset;
-    for (int i = 0; i < editor.cursor_y; ++i) {
-        uint8_t *s = memchr(editor.page + offset, '\n', editor.file.st_size - offset);
-        if (!s) {
-            // eof, return last byte
-            return editor.file.st_size - 1;
-        }
+    qe_search_stop();
+    qe_highlight_reset();
+    qe_regex_free(editor.search_buf_regex);
+    editor.search_buf_regex = NULL;
+    editor.search_buf_match = QE_SEARCH_PENDING;
 
-        offset = s - &editor.page[offset];
-        offset += 1;
+    qe_search_restore();
+}
+
+// Search for the last committed term from the cursor. `reverse` flips the
+// direction the term was committed with.
+static void qe_search_repeat(int reverse)
+{
+    if (editor.search_term_len == 0) {
+        snprintf(editor.status_buffer, sizeof(editor.status_buffer), "No previous search");
+        editor.status_message = 1;
+        editor.dirty = 1;
+        return;
     }
 
-    offset += editor.page_offset_x + editor.cursor_x;
+    reverse ^= editor.search_term_reverse;
+    const int64_t offset = qe_get_cursor_byte_position();
 
-    // could be passed the end of the file, cap
-    if (offset >= editor.file.st_size) {
-        offset = editor.file.st_size - 1;
+    // a complete match index answers directly
+    if (qe_matches_poll()) {
+        const struct qe_matches *mi = editor.matches;
+        const int64_t k = reverse ? qe_matches_rank(mi, offset) - 1 : qe_matches_rank(mi, offset + 1);
+        if (k >= 0 && k < mi->found) {
+            qe_search_stop();
+            qe_search_jump(qe_matches_at(mi, k));
+            return;
+        }
+    } else if (qe_search_start(offset, reverse)) {
+        qe_search_progress();
+        return;
     }
 
-    return offset;
+    qe_search_not_found();
 }
 
-// Search at byte offset for the entry in the search-buffer. Returns -1
-// on no match (EOF) else returns the offset which the search term was found at.
-static int64_t qe_search(int64_t offset)
+// Finish the search for the term just committed from the prompt, using what
+// the incremental search has found so far.
+static void qe_search_accept(void)
 {
-    // TODO: GNU specific
-    uint8_t *p = memmem(editor.page + offset, editor.file.st_size - offset,
-                        editor.search_buf, editor.search_len);
-    if (p == NULL) {
-        return -1;
+    const int64_t match = editor.search_buf_match;
+    editor.search_buf_match = QE_SEARCH_PENDING;
+
+    if (editor.search && editor.search->incremental) {
+        // still running, the result is applied like any other search
+        editor.search->incremental = 0;
+        qe_search_restore();
+        qe_search_progress();
+    } else if (match == -1) {
+        qe_search_not_found();
+    } else if (match != QE_SEARCH_PENDING) {
+        // the view is already at the match
+        qe_update_status_buffer();
+        editor.dirty = 1;
+    } else {
+        qe_search_restore();
+        qe_search_repeat(0);
     }
+}
+
+// Stop the background search without moving.
+static void qe_search_abort(void)
+{
+    qe_search_stop();
 
-    return p - editor.page;
+    qe_update_status_buffer();
+    snprintf(editor.status_buffer, sizeof(editor.status_buffer), "Search aborted");
+    editor.status_message = 1;
+    editor.dirty = 1;
 }
 
 // Move the cursor, possibly moving the viewport if we exceed screen space.
@@ -617,6 +6630,19 @@ static void qe_move_cursor_x(int32_t x)
 {
     assert(x != 0);
 
+    // fixed-size rows are moved through across rows
+    if (qe_row_size()) {
+        int64_t off = qe_get_cursor_byte_position() + x;
+        if (off < 0) {
+            off = 0;
+        } else if (off >= editor.file.st_size) {
+            off = editor.file.st_size - 1;
+        }
+
+        qe_row_show(off);
+        return;
+    }
+
     // TODO: Cursor cannot move right any more if next character is a newline
     // get_byte_position and check next character.
 
@@ -641,9 +6667,18 @@ static void qe_move_cursor_x(int32_t x)
     // still in the current view
     else {
         if (x > 0) {
-            uint64_t off = qe_get_cursor_byte_position();
-            if (editor.page[off + 1] == '\n') {
-                // TODO: Allow y movement here (separate into different functions)
+            // stop before the end of the line
+            //
+            // TODO: Allow y movement here (separate into different functions)
+            const int64_t off = qe_get_cursor_byte_position() + 1;
+            int64_t n = editor.file.st_size - off;
+            if (n > x) {
+                n = x;
+            }
+
+            const uint8_t *nl = qe_memchr(editor.page + off, '\n', n > 0 ? n : 0);
+            x = nl ? nl - (editor.page + off) : n;
+            if (x == 0) {
                 return;
             }
         }
@@ -662,130 +6697,620 @@ static void qe_move_cursor_y(int32_t y)
     // but retain the current column as well on the next line. If an x movement
     // occurs however then the virtual cursor is released.
 
+    editor.hex_nibble = 0;
+
     int32_t new_y = editor.cursor_y + y;
-    // off the top
+    // off the top, scroll up by the overshoot
     if (new_y < 0) {
         // cannot scan cursor off top of first page
         if (editor.page_offset == 0) {
-            return;
+            editor.cursor_y = 0;
+        } else {
+            qe_move_window_y(new_y);
+            editor.cursor_y = 0;
         }
-
-        // scan back a page
-        qe_move_window_y(-terminal.height / 2);
+    }
+    // off the bottom, scroll down by the overshoot
+    //
+    // Small scrolls are drawn by shifting the terminal content, so only the
+    // newly exposed rows are sent.
+    else if (new_y >= terminal.height - 1) {
+        qe_move_window_y(new_y - (terminal.height - 2));
         editor.cursor_y = terminal.height - 2;
+    }
+    // still in current view
+    else {
+        editor.cursor_y += y;
+    }
+
+    editor.dirty_cursor = 1;
+}
+
+// Move the view to the start of the line (or row) containing byte `offset`,
+// with the cursor on the byte.
+static void qe_goto_offset(int64_t offset)
+{
+    if (offset < 0) {
+        offset = 0;
+    } else if (offset >= editor.file.st_size) {
+        offset = editor.file.st_size - 1;
+    }
+
+    const int64_t size = qe_row_size();
+    if (size) {
+        editor.page_offset = offset - offset % size;
+        qe_row_show(offset);
         editor.dirty = 1;
+        return;
     }
-    // off the bottom
-    else if (new_y >= terminal.height - 1) {
-        qe_move_window_y(terminal.height / 2);
+
+    const int64_t start = qe_line_start(offset);
+    const int64_t column = offset - start;
+    editor.page_offset = start;
+    editor.page_offset_x = column - column % terminal.width;
+    editor.cursor_x = column % terminal.width;
+    editor.cursor_y = 0;
+    editor.dirty_cursor = 1;
+
+    qe_update_status_buffer();
+    editor.dirty = 1;
+}
+
+// Move the view to line `line` (0-based), or the last line if there are
+// fewer. In the record view lines are records.
+//
+// The full line index finds any line directly. Until it is complete, the
+// nearest checkpoint is looked up and the remaining lines are scanned.
+static void qe_goto_line(int64_t line)
+{
+    int64_t offset;
+    if (editor.record) {
+        offset = line < editor.file.st_size / editor.record ?
+                 line * editor.record : editor.file.st_size - 1;
+    } else if (qe_lines_poll()) {
+        const int64_t last = qe_lines_count() - 1;
+        offset = qe_lines_offset(line < last ? line : last);
+    } else {
+        int64_t cp_line, cp_offset;
+        qe_line_index_seek(line, &cp_line, &cp_offset);
+        offset = qe_line_forward(cp_offset, line - cp_line);
+    }
+
+    qe_goto_offset(offset);
+}
+
+// Move the view to `percent` percent through the file.
+static void qe_goto_percent(int64_t percent)
+{
+    if (percent > 100) {
+        percent = 100;
+    }
+
+    // split to avoid overflow on huge files
+    const int64_t size = editor.file.st_size;
+    qe_goto_offset(size / 100 * percent + size % 100 * percent / 100);
+}
+
+// Move the view to the end of the file, with the last line on the last row
+// and the cursor on it.
+//
+// Only the new-lines of the rows shown are scanned, backward from the end, so
+// this costs the same for any file size.
+static void qe_goto_end(void)
+{
+    const int64_t rows = terminal.height > 1 ? terminal.height - 1 : 1;
+    if (editor.file.st_size == 0) {
+        editor.page_offset = 0;
+        editor.page_offset_x = 0;
+        editor.cursor_x = 0;
         editor.cursor_y = 0;
+        qe_update_status_buffer();
+        editor.dirty = 1;
+        return;
+    }
+
+    const int64_t size = qe_row_size();
+    if (size) {
+        const int64_t last = (editor.file.st_size - 1) / size * size;
+        editor.page_offset = last > (rows - 1) * size ? last - (rows - 1) * size : 0;
+        qe_row_show(editor.file.st_size - 1);
+        editor.dirty = 1;
+        return;
+    }
+
+    // a trailing new-line ends the last line rather than starting another
+    const int64_t last = qe_line_start(editor.file.st_size - 1);
+    editor.page_offset = qe_line_backward(last, rows - 1);
+    editor.page_offset_x = 0;
+    editor.cursor_x = 0;
+    editor.cursor_y = qe_line_count(editor.page_offset, last);
+    editor.dirty_cursor = 1;
+
+    qe_update_status_buffer();
+    editor.dirty = 1;
+}
+
+// Switch between the hex view and the text or record view, keeping the cursor
+// on the same byte.
+static void qe_toggle_hex(void)
+{
+    const int64_t off = qe_get_cursor_byte_position();
+    editor.hex = !editor.hex;
+    editor.hex_nibble = 0;
+    editor.dirty = 1;
+
+    const int64_t size = qe_row_size();
+    if (size) {
+        editor.page_offset -= editor.page_offset % size;
+        editor.page_offset_x = 0;
+        qe_row_show(off);
+        return;
+    }
+
+    qe_goto_offset(off);
+}
+
+// How long after the last edit its pages are synced.
+#define QE_SYNC_MS 250
+
+// Edits further than this from the unsynced range sync that range first, so a
+// single msync never walks a large part of a huge file.
+#define QE_SYNC_SPAN (1 << 20)
+
+// A byte overwritten by an edit and its previous value.
+struct qe_edit {
+    int64_t offset;
+    uint8_t old;
+};
+
+// Edits made to the file.
+//
+// Every edit overwrites a byte in place through the mapping. The bytes are
+// synced to the file in batches rather than on every key, and the previous
+// values are kept so edits can be undone.
+static struct {
+    struct qe_edit *undo;
+    size_t count;
+    size_t cap;
+
+    // Range of the file written but not yet synced, empty if lo == hi.
+    int64_t lo;
+    int64_t hi;
+} edits;
+
+// Sync the pages written since the last sync.
+static void qe_edit_sync(void)
+{
+    static size_t page_size = 0;
+    if (page_size == 0) {
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+    }
+
+    if (edits.lo == edits.hi) {
+        return;
+    }
+
+    // align to page
+    const int64_t begin = edits.lo - edits.lo % page_size;
+    int r = msync(editor.page + begin, edits.hi - begin, MS_SYNC | MS_INVALIDATE);
+    if (r == -1) {
+        fatal("failed to msync");
+    }
+
+    edits.lo = edits.hi = 0;
+}
+
+static void qe_line_index_progress(void);
+
+// Overwrite the byte at `off` with `c`. The previous value is recorded for
+// undo if `record` is set.
+static void qe_edit_byte(int64_t off, uint8_t c, int record)
+{
+    if (record) {
+        if (edits.count == edits.cap) {
+            const size_t cap = edits.cap ? 2 * edits.cap : 256;
+            struct qe_edit *undo = realloc(edits.undo, cap * sizeof(struct qe_edit));
+            if (undo == NULL) {
+                fatal("failed to allocate undo buffer");
+            }
+            edits.undo = undo;
+            edits.cap = cap;
+        }
+
+        edits.undo[edits.count].offset = off;
+        edits.undo[edits.count].old = editor.page[off];
+        edits.count += 1;
+    }
+
+    const uint8_t old = editor.page[off];
+    editor.page[off] = c;
+
+    // the match index and highlight no longer reflect the file, nor the line
+    // index if a line was split or joined
+    qe_matches_stop();
+    qe_highlight_reset();
+    if ((old == '\n') != (c == '\n')) {
+        qe_lines_stop();
+        qe_line_index_cut(off);
+        qe_line_index_progress();
+    }
+
+    if (edits.lo != edits.hi &&
+            (off + QE_SYNC_SPAN < edits.lo || off >= edits.hi + QE_SYNC_SPAN)) {
+        qe_edit_sync();
+    }
+
+    if (edits.lo == edits.hi) {
+        edits.lo = off;
+        edits.hi = off + 1;
+    } else if (off < edits.lo) {
+        edits.lo = off;
+    } else if (off >= edits.hi) {
+        edits.hi = off + 1;
+    }
+
+    if (!editor.batched_save) {
+        qe_loop_defer(qe_edit_sync, QE_SYNC_MS);
+    }
+
+    editor.dirty = 1;
+}
+
+// Undo the last edit, showing the restored byte.
+static void qe_edit_undo(void)
+{
+    if (edits.count == 0) {
+        snprintf(editor.status_buffer, sizeof(editor.status_buffer), "Nothing to undo");
+        editor.status_message = 1;
         editor.dirty = 1;
+        return;
+    }
+
+    edits.count -= 1;
+    const struct qe_edit *edit = &edits.undo[edits.count];
+    qe_edit_byte(edit->offset, edit->old, 0);
+
+    if (qe_row_size()) {
+        qe_row_show(edit->offset);
+    } else {
+        qe_search_jump(edit->offset);
+    }
+}
+
+// Overwrite the byte under the cursor with a typed key. In the hex view keys
+// are hex digits and each replaces one digit of the byte, moving to the next
+// byte once both have been typed.
+static void qe_edit_key(int c)
+{
+    const int64_t off = qe_get_cursor_byte_position();
+
+    if (!editor.hex) {
+        qe_edit_byte(off, c, 1);
+
+        // advance the cursor, possibly moving to the next line
+        if (!editor.record && off + 1 < editor.file.st_size && editor.page[off + 1] == '\n') {
+            editor.cursor_x = 0;
+            editor.cursor_y += 1;
+            editor.dirty_cursor = 1;
+        } else {
+            qe_move_cursor_x(1);
+        }
+        return;
+    }
+
+    const int v = c < 0x80 ? qe_re_hex(c) : -1;
+    if (v == -1) {
+        return;
+    }
+
+    if (editor.hex_nibble == 0) {
+        qe_edit_byte(off, (v << 4) | (editor.page[off] & 0x0f), 1);
+        editor.hex_nibble = 1;
+        editor.dirty_cursor = 1;
+    } else if (off + 1 < editor.file.st_size) {
+        qe_edit_byte(off, (editor.page[off] & 0xf0) | v, 0);
+        qe_row_show(off + 1);
+    } else {
+        // stay on the last byte of the file
+        qe_edit_byte(off, (editor.page[off] & 0xf0) | v, 0);
+        editor.hex_nibble = 0;
+        editor.dirty_cursor = 1;
+    }
+}
+
+// Size of the input ring buffer. Must be a power of two.
+#define QE_INPUT_SIZE 4096
+
+// How long to wait for the rest of an escape sequence before treating ESC as
+// a key press by itself.
+#define QE_ESC_MS 25
+
+// Buffered terminal input.
+//
+// Everything available is drained with as few reads as possible and keys are
+// parsed from the buffer. Free-running indices are masked on access.
+static struct {
+    uint8_t buf[QE_INPUT_SIZE];
+    uint32_t head;
+    uint32_t tail;
+} input;
+
+// Read all available input into the ring buffer.
+static void qe_input_fill(void)
+{
+    while (input.tail - input.head < QE_INPUT_SIZE) {
+        const uint32_t at = input.tail & (QE_INPUT_SIZE - 1);
+        size_t space = QE_INPUT_SIZE - (input.tail - input.head);
+        if (space > QE_INPUT_SIZE - at) {
+            space = QE_INPUT_SIZE - at;
+        }
+
+        errno = 0;
+        ssize_t n = read(STDIN_FILENO, input.buf + at, space);
+        if (n <= 0) {
+            if (n == 0 || errno == EINTR || errno == EAGAIN) {
+                return;
+            }
+
+            fatal("failed to read input key");
+        }
+
+        input.tail += n;
+        if ((size_t) n < space) {
+            return;
+        }
+    }
+}
+
+// Return the i'th unconsumed input byte, or -1 if not yet received.
+static inline int qe_input_peek(uint32_t i)
+{
+    if (i >= input.tail - input.head) {
+        return -1;
+    }
+
+    return input.buf[(input.head + i) & (QE_INPUT_SIZE - 1)];
+}
+
+// Parse the next key from the input buffer without consuming it.
+//
+// Returns the number of bytes the key spans, or 0 if there is no complete key
+// yet. An incomplete escape sequence is only returned (as ESC) once `flush` is
+// set, after the sequence timed out.
+static int qe_input_parse(int *key, int flush)
+{
+    const int c = qe_input_peek(0);
+    if (c == -1) {
+        return 0;
+    }
+
+    if (c != '\x1b') {
+        *key = c;
+        return 1;
+    }
+
+    const int c1 = qe_input_peek(1);
+    const int c2 = qe_input_peek(2);
+    *key = '\x1b';
+
+    if (c1 != '[' && c1 != 'O' && c1 != -1) {
+        // a lone ESC followed by another key
+        return 1;
+    }
+
+    if (c1 == -1 || c2 == -1) {
+        return flush ? (c1 == -1 ? 1 : 2) : 0;
+    }
+
+    if (c1 == '[') {
+        if (c2 >= '0' && c2 <= '9') {
+            const int c3 = qe_input_peek(3);
+            if (c3 == -1) {
+                return flush ? 3 : 0;
+            }
+
+            if (c3 == '~') {
+                switch (c2) {
+                    case '1':
+                    case '7':
+                        *key = HOME;
+                        break;
+                    case '4':
+                    case '8':
+                        *key = END;
+                        break;
+                    case '3':
+                        *key = DEL;
+                        break;
+                    case '5':
+                        *key = PGUP;
+                        break;
+                    case '6':
+                        *key = PGDN;
+                        break;
+                    default:
+                        break;
+                }
+            }
+
+            return 4;
+        }
+
+        switch (c2) {
+            case 'A':
+                *key = ARROW_UP;
+                break;
+            case 'B':
+                *key = ARROW_DOWN;
+                break;
+            case 'C':
+                *key = ARROW_RIGHT;
+                break;
+            case 'D':
+                *key = ARROW_LEFT;
+                break;
+            case 'H':
+                *key = HOME;
+                break;
+            case 'F':
+                *key = END;
+                break;
+            default:
+                break;
+        }
+    } else {
+        switch (c2) {
+            case 'H':
+                *key = HOME;
+                break;
+            case 'F':
+                *key = END;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return 3;
+}
+
+static void qe_command_prompt(void)
+{
+    snprintf(editor.status_buffer, sizeof(editor.status_buffer), ":%s", editor.command_buf);
+    editor.dirty = 1;
+}
+
+// Parse a non-negative decimal or 0x prefixed hex number making up all of
+// `s`. Returns -1 if it is not one.
+static int64_t qe_command_number(const char *s)
+{
+    int base = 10;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        s += 2;
     }
-    // still in current view
-    else {
-        editor.cursor_y += y;
+
+    if (!isxdigit((unsigned char) s[0])) {
+        return -1;
     }
 
-    editor.dirty_cursor = 1;
+    char *end;
+    errno = 0;
+    const long long v = strtoll(s, &end, base);
+    return *end == 0 && errno == 0 && v >= 0 ? v : -1;
 }
 
-// Read a single input key.
+// Run the command typed after ':'.
 //
-// This blocks until user input is received OR a signal occurs.
-static int qe_readkey(void)
+//  :N       go to line N
+//  :N%      go to N percent through the file
+//  :o N     go to byte offset N, which may be hex with a 0x prefix
+static void qe_command_run(void)
 {
-    ssize_t n;
-    char c;
-
-    errno = 0;
-    while ((n = read(STDIN_FILENO, &c, 1)) == 0) {
-        sched_yield();
+    char *cmd = editor.command_buf;
+    while (*cmd == ' ') {
+        cmd += 1;
     }
 
-    if (n == -1) {
-        // If a signal occurs during the above read call then it will fail
-        // with the error code EINTR since we did not use SA_RESTART.
-        //
-        // In this case, we want to stop reading immediately to give the
-        // program the chance to immediately update the buffer content.
-        if (errno == EINTR) {
-            return 0;
+    int64_t n = -1;
+    if (cmd[0] == 'o' && cmd[1] == ' ') {
+        cmd += 2;
+        while (*cmd == ' ') {
+            cmd += 1;
         }
-
-        fatal("failed to read input key");
+        if ((n = qe_command_number(cmd)) != -1) {
+            qe_goto_offset(n);
+            return;
+        }
+    } else if (cmd[0] != 0 && cmd[strlen(cmd) - 1] == '%') {
+        cmd[strlen(cmd) - 1] = 0;
+        if ((n = qe_command_number(cmd)) != -1) {
+            qe_goto_percent(n);
+            return;
+        }
+        cmd[strlen(cmd)] = '%';
+    } else if ((n = qe_command_number(cmd)) != -1) {
+        qe_goto_line(n > 0 ? n - 1 : 0);
+        return;
     }
 
-    if (c == '\x1b') {
-        char c1, c2, c3;
+    qe_update_status_buffer();
+    snprintf(editor.status_buffer, sizeof(editor.status_buffer),
+             "Invalid command: %s", editor.command_buf);
+    editor.status_message = 1;
+    editor.dirty = 1;
+}
 
-        if (read(STDIN_FILENO, &c1, 1) != 1 || read(STDIN_FILENO, &c2, 1) != 1) {
-            return '\x1b';
-        }
+// Whether consecutive presses of `c` in the current mode can be handled as a
+// single movement with a count.
+static int qe_key_repeats(int c)
+{
+    switch (c) {
+        case PGDN:
+        case PGUP:
+        case ARROW_DOWN:
+        case ARROW_UP:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case CTRL('d'):
+        case CTRL('u'):
+        case CTRL('h'):
+        case CTRL('l'):
+            return !qe_prompt_open(editor.mode);
+
+        case 'j':
+        case 'k':
+        case 'h':
+        case 'l':
+            return editor.mode == MODE_NORMAL;
+
+        default:
+            return 0;
+    }
+}
 
-        if (c1 == '[') {
-            if (c2 >= '0' && c2 <= '9') {
-                if (read(STDIN_FILENO, &c3, 1) != 1) {
-                    return '\x1b';
-                }
+// Largest count typed before a key.
+#define QE_COUNT_MAX ((int64_t) 1 << 50)
 
-                if (c3 == '~') {
-                    switch (c2) {
-                        case '1':
-                        case '7':
-                            return HOME;
-                        case '4':
-                        case '8':
-                            return END;
-                        case '3':
-                            return DEL;
-                        case '5':
-                            return PGUP;
-                        case '6':
-                            return PGDN;
-                        default:
-                            break;
-                    }
-                }
-            } else {
-                switch (c2) {
-                    case 'A':
-                        return ARROW_UP;
-                    case 'B':
-                        return ARROW_DOWN;
-                    case 'C':
-                        return ARROW_RIGHT;
-                    case 'D':
-                        return ARROW_LEFT;
-                    case 'H':
-                        return HOME;
-                    case 'F':
-                        return END;
-                    default:
-                        break;
-                }
-            }
-        } else if (c1 == 'O') {
-            switch (c2) {
-                case 'H':
-                    return HOME;
-                case 'F':
-                    return END;
-                default:
-                    break;
-            }
-        }
+// Largest count applied to a movement key. Larger moves should use G or %.
+#define QE_COUNT_MOVE_MAX (1 << 20)
 
-        return '\x1b';
-    } else {
-        return c;
+// Process key `c`, pressed `count` times in a row. Only movement keys (see
+// qe_key_repeats) are ever given a count other than 1, either by repeated
+// presses or a typed count.
+static void qe_process_key(int c, int count)
+{
+    // A running search is aborted rather than leaving the editor.
+    if (editor.search && !qe_prompt_open(editor.mode) && (c == ESC || c == CTRL('c'))) {
+        qe_search_abort();
+        return;
+    }
+
+    // An empty file, which is only opened when following, has nothing to
+    // move over, search or edit until it grows.
+    if (editor.file.st_size == 0 && c != 'q' && c != CTRL('c') && c != 'r' && c != 'w') {
+        return;
     }
-}
 
-static void qe_process_key(int c)
-{
     switch (editor.mode) {
         case MODE_NORMAL:
         {
+            // a count applies to the next key
+            if ((c >= '1' && c <= '9') || (c == '0' && editor.count)) {
+                if (editor.count < QE_COUNT_MAX) {
+                    editor.count = editor.count * 10 + c - '0';
+                }
+                break;
+            }
+
+            const int64_t prefix = editor.count;
+            editor.count = 0;
+            if (prefix && qe_key_repeats(c)) {
+                // repeats of the key coalesced with it add to the count
+                const int64_t n = prefix + count - 1;
+                count = n < QE_COUNT_MOVE_MAX ? n : QE_COUNT_MOVE_MAX;
+            }
+
             // normal mode
             switch (c) {
                 // TODO: Are you sure on quit.
@@ -800,20 +7325,65 @@ static void qe_process_key(int c)
                     break;
 
                 case '/':
+                case '?':
                     editor.mode = MODE_SEARCH;
-
-                    editor.status_buffer[0] = '/';
-                    editor.status_buffer[1] = 0;
+                    editor.search_reverse = c == '?';
 
                     editor.search_buf[0] = 0;
                     editor.search_len = 0;
 
-                    editor.dirty = 1;
+                    editor.search_origin.page_offset = editor.page_offset;
+                    editor.search_origin.page_offset_x = editor.page_offset_x;
+                    editor.search_origin.cursor_x = editor.cursor_x;
+                    editor.search_origin.cursor_y = editor.cursor_y;
+                    editor.search_origin.offset = qe_get_cursor_byte_position();
+                    editor.search_buf_match = QE_SEARCH_PENDING;
+                    qe_highlight_reset();
+
+                    qe_search_prompt();
+                    break;
+
+                case ':':
+                    editor.mode = MODE_COMMAND;
+                    editor.command_buf[0] = 0;
+                    editor.command_len = 0;
+                    qe_command_prompt();
+                    break;
+
+                case 'G':
+                    if (prefix) {
+                        qe_goto_line(prefix - 1);
+                    } else {
+                        qe_goto_end();
+                    }
+                    break;
+
+                case END:
+                    qe_goto_end();
+                    break;
+
+                case HOME:
+                    qe_goto_offset(0);
+                    break;
+
+                case '%':
+                    if (prefix) {
+                        qe_goto_percent(prefix);
+                    }
+                    break;
+
+                case 'n':
+                    qe_search_repeat(0);
+                    break;
+
+                case 'N':
+                    qe_search_repeat(1);
                     break;
 
                 case 'r':
                     // Force a refresh, useful if multiple editors at once on
                     // the same file.
+                    grid.valid = 0;
                     editor.dirty = 1;
                     break;
 
@@ -823,42 +7393,52 @@ static void qe_process_key(int c)
                     editor.dirty = 1;
                     break;
 
+                case 'x':
+                    qe_toggle_hex();
+                    break;
+
+                case 'u':
+                    if (!editor.read_only) {
+                        qe_edit_undo();
+                    }
+                    break;
+
                 case PGDN:
                 case CTRL('d'):
-                    qe_move_window_y(terminal.height - 1);
+                    qe_move_window_y(count * (terminal.height - 1));
                     break;
 
                 case PGUP:
                 case CTRL('u'):
-                    qe_move_window_y(-(terminal.height - 1));
+                    qe_move_window_y(-count * (terminal.height - 1));
                     break;
 
                 case ARROW_DOWN:
                 case 'j':
-                    qe_move_cursor_y(1);
+                    qe_move_cursor_y(count);
                     break;
 
                 case ARROW_UP:
                 case 'k':
-                    qe_move_cursor_y(-1);
+                    qe_move_cursor_y(-count);
                     break;
 
                 case ARROW_LEFT:
                 case 'h':
-                    qe_move_cursor_x(-1);
+                    qe_move_cursor_x(-count);
                     break;
 
                 case ARROW_RIGHT:
                 case 'l':
-                    qe_move_cursor_x(1);
+                    qe_move_cursor_x(count);
                     break;
 
                 case CTRL('h'):
-                    qe_move_window_x(-terminal.width / 2);
+                    qe_move_window_x(-count * (terminal.width / 2));
                     break;
 
                 case CTRL('l'):
-                    qe_move_window_x(terminal.width / 2);
+                    qe_move_window_x(count * (terminal.width / 2));
                     break;
 
                 default:
@@ -875,82 +7455,52 @@ static void qe_process_key(int c)
 
                 case ESC:
                     editor.mode = MODE_NORMAL;
+                    editor.hex_nibble = 0;
+                    editor.dirty_cursor = 1;
+                    qe_edit_sync();
                     break;
 
                 case PGDN:
                 case CTRL('d'):
-                    qe_move_window_y(terminal.height - 1);
+                    qe_move_window_y(count * (terminal.height - 1));
                     break;
 
                 case PGUP:
                 case CTRL('u'):
-                    qe_move_window_y(-(terminal.height - 1));
+                    qe_move_window_y(-count * (terminal.height - 1));
                     break;
 
                 case ARROW_DOWN:
-                    qe_move_cursor_y(1);
+                    qe_move_cursor_y(count);
                     break;
 
                 case ARROW_UP:
-                    qe_move_cursor_y(-1);
+                    qe_move_cursor_y(-count);
                     break;
 
                 case ARROW_LEFT:
-                    qe_move_cursor_x(-1);
+                    qe_move_cursor_x(-count);
                     break;
 
                 case ARROW_RIGHT:
-                    qe_move_cursor_x(1);
+                    qe_move_cursor_x(count);
                     break;
 
                 case CTRL('h'):
-                    qe_move_window_x(-terminal.width / 2);
+                    qe_move_window_x(-count * (terminal.width / 2));
                     break;
 
                 case CTRL('l'):
-                    qe_move_window_x(terminal.width / 2);
+                    qe_move_window_x(count * (terminal.width / 2));
                     break;
 
                 default:
-                {
-                    static size_t page_size = 0;
-                    if (page_size == 0) {
-                        page_size = (size_t) sysconf(_SC_PAGESIZE);
-                    }
-
-                    // TODO: Ringbuffer storing a sequence of edits. Head is the
-                    // first pending edit, tail is the latest edit to apply.
-                    //
-                    // Saving applies all edits to the file and keeps the edits
-                    // in the buffer as a history set.
-                    //
-                    // Need a sentinel value to signal incomplete buffer.
-                    //
-                    // This should actually be an option to require hitting
-                    // an explicit save. Still keep the undo buffer, though.
-                    int64_t off = qe_get_cursor_byte_position();
-                    editor.page[off] = c;
-
-                    // align to page
-                    uint8_t *page_addr = editor.page + off - (off % page_size);
-                    int r = msync(page_addr, page_size, MS_SYNC | MS_INVALIDATE);
-                    if (r == -1) {
-                        fatal("failed to msync");
-                    }
-
-                    // advance the cursor, possibly moving to the next line
-                    if (editor.page[off + 1] == '\n') {
-                        editor.cursor_x = 0;
-                        editor.cursor_y += 1;
-                        editor.dirty_cursor = 1;
-                    } else {
-                        qe_move_cursor_x(1);
+                    // keys past the byte range, like HOME, END and DEL, do
+                    // not edit
+                    if (c <= 0xff) {
+                        qe_edit_key(c);
                     }
-
-                    // TODO: Partial dirty state would be good
-                    editor.dirty = 1;
-                }
-                break;
+                    break;
             }
         }
         break;
@@ -963,6 +7513,7 @@ static void qe_process_key(int c)
 
                 case ESC:
                     editor.mode = MODE_NORMAL;
+                    qe_search_cancel();
                     break;
 
                 case ENTER:
@@ -970,64 +7521,92 @@ static void qe_process_key(int c)
                     // Search always switches mode
                     editor.mode = MODE_NORMAL;
 
-                    // TODO: Add a flag to highlight the last match in the
-                    // buffer. Empty search highlighting?
+                    // Search from where the prompt was opened. The result
+                    // is applied once the search completes.
+                    if (qe_search_commit()) {
+                        qe_search_accept();
+                        qe_matches_start();
+                    }
+
+                    editor.dirty = 1;
+                }
+                break;
 
-                    // Search from the current location forward.
+                case CTRL('r'):
+                    editor.search_regex = !editor.search_regex;
+                    qe_search_incremental();
+                    qe_search_prompt();
+                    break;
 
-                    int64_t off = qe_get_cursor_byte_position();
-                    int64_t actual_addr = qe_search(off + 1);
-                    if (actual_addr == -1) {
-                        break;
-                    }
+                case CTRL('f'):
+                    editor.search_fold = !editor.search_fold;
+                    qe_search_incremental();
+                    qe_search_prompt();
+                    break;
 
-                    int64_t addr = actual_addr;
+                case CTRL('x'):
+                    editor.search_hex = !editor.search_hex;
+                    qe_search_incremental();
+                    qe_search_prompt();
+                    break;
 
-                    // Go to the address, then, go to the start of the line
-                    // where the entry occurred.
-                    while (addr > 0 && editor.page[addr] != '\n') {
-                        addr -= 1;
+                default:
+                    if (c == BACKSPACE) {
+                        if (editor.search_len != 0) {
+                            editor.search_len -= 1;
+                        }
                     }
-                    if (addr != 0) {
-                        addr += 1;
+                    // cap search term to 64 characters
+                    else if (editor.search_len < sizeof(editor.search_buf) - 1) {
+                        editor.search_buf[editor.search_len++] = c;
                     }
+                    editor.search_buf[editor.search_len] = 0;
+
+                    qe_search_incremental();
 
-                    // TODO: Shift the page_offset_x in one computation directly.
-                    // based on terminal width.
-                    editor.page_offset = addr;
+                    // fill the status buffer so we can see what is being
+                    qe_search_prompt();
+                    break;
+            }
+        }
+        break;
 
-                    // TODO: Round page_offset_x to editor terminal size and
-                    // set cursor based on this.
-                    editor.page_offset_x = actual_addr - addr;
+        case MODE_COMMAND:
+        {
+            switch (c) {
+                case CTRL('c'):
+                    exit(0);
 
+                case ESC:
+                    editor.mode = MODE_NORMAL;
+                    qe_update_status_buffer();
                     editor.dirty = 1;
-                }
-                break;
+                    break;
 
-                default:
-                    // cap search term to 64 characters
-                    if (editor.search_len >= sizeof(editor.search_buf) - 1) {
+                case ENTER:
+                    editor.mode = MODE_NORMAL;
+                    qe_command_run();
+                    break;
+
+                case BACKSPACE:
+                    // deleting past the start closes the prompt
+                    if (editor.command_len == 0) {
+                        editor.mode = MODE_NORMAL;
+                        qe_update_status_buffer();
+                        editor.dirty = 1;
                         break;
                     }
+                    editor.command_buf[--editor.command_len] = 0;
+                    qe_command_prompt();
+                    break;
 
-                    if (c != BACKSPACE) {
-                        editor.search_buf[editor.search_len++] = c;
-                        editor.search_buf[editor.search_len] = 0;
-                    } else {
-                        editor.search_len -= 1;
-                        if (editor.search_len == 0) {
-                            editor.search_len = 0;
-                        }
-
-                        editor.search_buf[editor.search_len] = 0;
+                default:
+                    if (c < 0x80 && isprint(c) &&
+                            editor.command_len < sizeof(editor.command_buf) - 1) {
+                        editor.command_buf[editor.command_len++] = c;
+                        editor.command_buf[editor.command_len] = 0;
                     }
-
-                    // fill the status buffer so we can see what is being
-                    editor.status_buffer[0] = '/';
-                    editor.status_buffer[1] = 0;
-                    strncpy(editor.status_buffer + 1, editor.search_buf, sizeof(editor.status_buffer) - 1);
-                    editor.dirty = 1;
-
+                    qe_command_prompt();
                     break;
             }
         }
@@ -1035,42 +7614,270 @@ static void qe_process_key(int c)
     }
 }
 
+// Refresh indexing progress in the status line until the index is complete.
+static void qe_line_index_progress(void)
+{
+    if (!line_index.running || __atomic_load_n(&line_index.complete, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    if (!qe_prompt_open(editor.mode) && !editor.status_message) {
+        qe_update_status_buffer();
+        editor.dirty = 1;
+    }
+    qe_loop_defer(qe_line_index_progress, QE_PROGRESS_MS);
+}
+
+// Follow mode.
+//
+// The followed file is mapped with QE_FOLLOW_RESERVE bytes to spare, so data
+// appended to it is read in place and <page> never moves under the background
+// threads. Writes are reported by inotify and coalesced into a poll at most
+// every QE_FOLLOW_MS, which takes the new size, extends the indexes over the
+// new data and, if the cursor was on the last line, moves the view to the new
+// end. The rows already on screen are then scrolled rather than redrawn.
+
+// Most often a followed file is checked for growth.
+#define QE_FOLLOW_MS 50
+
+static struct {
+    // inotify descriptor watching <file>, or -1 if the file is polled every
+    // QE_FOLLOW_MS instead.
+    int fd;
+
+    // Set while a poll is deferred.
+    int pending;
+} follow;
+
+// Return whether the cursor is on the last row of the file.
+static int qe_follow_pinned(void)
+{
+    if (editor.file.st_size == 0) {
+        return 1;
+    }
+
+    const int64_t off = qe_get_cursor_byte_position();
+    const int64_t size = qe_row_size();
+    if (size) {
+        return off / size == (editor.file.st_size - 1) / size;
+    }
+    return off >= qe_line_start(editor.file.st_size - 1);
+}
+
+static void qe_follow_poll(void)
+{
+    follow.pending = 0;
+    if (follow.fd == -1) {
+        qe_loop_defer(qe_follow_poll, QE_FOLLOW_MS);
+    }
+
+    struct stat st;
+    if (fstat(editor.fd, &st) == -1 || st.st_size == editor.file.st_size) {
+        return;
+    }
+
+    if (st.st_size < editor.file.st_size) {
+        // the pages past the new end can no longer be read
+        errno = 0;
+        fatal("file was truncated");
+    }
+
+    const int64_t size = st.st_size < editor.page_size ? st.st_size : editor.page_size;
+    if (size == editor.file.st_size) {
+        return;
+    }
+
+    const int pinned = editor.mode == MODE_NORMAL && qe_follow_pinned();
+
+    // background threads read the size while it changes
+    __atomic_store_n(&editor.file.st_size, size, __ATOMIC_RELEASE);
+    editor.file.st_mtim = st.st_mtim;
+
+    // the match index only covers the old data, so searches scan again
+    qe_matches_stop();
+    qe_highlight_reset();
+    qe_lines_extend();
+    qe_line_index_resume();
+    qe_line_index_progress();
+
+    if (pinned) {
+        qe_goto_end();
+    } else if (!qe_prompt_open(editor.mode) && !editor.status_message) {
+        qe_update_status_buffer();
+    }
+    editor.dirty = 1;
+
+    if (size < st.st_size) {
+        snprintf(editor.status_buffer, sizeof(editor.status_buffer),
+                 "File grew past what can be followed");
+        editor.status_message = 1;
+    }
+}
+
+static void qe_follow_ready(void)
+{
+    char buf[4096];
+    while (read(follow.fd, buf, sizeof(buf)) > 0) {
+    }
+
+    if (!follow.pending) {
+        follow.pending = 1;
+        qe_loop_defer(qe_follow_poll, QE_FOLLOW_MS);
+    }
+}
+
+// Start watching the file for growth. Without inotify it is polled instead.
+static void qe_follow_init(void)
+{
+    follow.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow.fd != -1 && inotify_add_watch(follow.fd, editor.filename, IN_MODIFY) == -1) {
+        close(follow.fd);
+        follow.fd = -1;
+    }
+
+    if (follow.fd == -1) {
+        qe_loop_defer(qe_follow_poll, QE_FOLLOW_MS);
+        return;
+    }
+    qe_loop_add(follow.fd, qe_follow_ready);
+}
+
+// A background job has made progress or completed.
+static void qe_loop_wake_ready(void)
+{
+    uint64_t count;
+    if (read(loop.wake_fd, &count, sizeof(count)) == -1) {
+        return;
+    }
+
+    qe_line_index_poll();
+    if (editor.search) {
+        qe_search_poll();
+        return;
+    }
+
+    if (!qe_prompt_open(editor.mode) && !editor.status_message) {
+        qe_update_status_buffer();
+        editor.dirty = 1;
+    }
+}
+
+static void qe_input_timeout(void);
+
+// Process every complete key in the input buffer.
+//
+// Runs of the same movement key are coalesced into a single movement with a
+// count, so auto-repeat that has queued up costs one movement and one frame.
+static void qe_input_process(int flush)
+{
+    int c, n;
+    while ((n = qe_input_parse(&c, flush)) != 0) {
+        input.head += n;
+
+        int count = 1;
+        if (qe_key_repeats(c)) {
+            int next;
+            while ((n = qe_input_parse(&next, 0)) != 0 && next == c) {
+                input.head += n;
+                count += 1;
+            }
+        }
+
+        // if the mode changes, update the buffer. Leaving a prompt sets its
+        // own status.
+        enum edit_mode mode = editor.mode;
+        editor.status_message = 0;
+        qe_process_key(c, count);
+        // TODO: Change how we update the buffer
+        if (mode != editor.mode && !qe_prompt_open(editor.mode) && !qe_prompt_open(mode)) {
+            qe_update_status_buffer();
+            editor.dirty = 1;
+        }
+    }
+
+    // the rest of an escape sequence may still be in flight
+    if (input.head != input.tail) {
+        qe_loop_defer(qe_input_timeout, QE_ESC_MS);
+    }
+}
+
+static void qe_input_timeout(void)
+{
+    qe_input_process(1);
+}
+
+static void qe_input_ready(void)
+{
+    qe_input_fill();
+    qe_input_process(0);
+}
+
+// Print the offset of every match of the hex pattern given with -x, one per
+// line, and exit. Exits with 1 if there is no match, like grep.
+static void qe_batch_hex(void)
+{
+    const char *error;
+    struct qe_regex *re = qe_regex_hex((const uint8_t *) editor.batch_hex, strlen(editor.batch_hex), &error);
+    if (re == NULL) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "invalid hex pattern: %s", error);
+        errno = 0;
+        fatal(msg);
+    }
+
+    const int64_t size = editor.file.st_size;
+    int found = 0;
+    for (int64_t p = 0; p < size; ) {
+        const uint8_t *q = scan.pmem(editor.page + p, size - p, re->pattern);
+        if (q == NULL) {
+            break;
+        }
+
+        p = q - editor.page;
+        printf("%"PRId64"\n", p);
+        found = 1;
+        p += 1;
+    }
+
+    qe_regex_free(re);
+    exit(found ? 0 : 1);
+}
+
 int main(int argc, char **argv)
 {
     qe_init();
+    qe_scan_init();
     qe_args(argc, argv);
     qe_open();
+    if (editor.batch_hex) {
+        qe_batch_hex();
+    }
+    qe_loop_init();
+    qe_line_index_init();
+    qe_lines_start();
     qe_init_terminal();
     qe_update_status_buffer();
+    if (editor.tail) {
+        qe_goto_end();
+    }
 
-    while (1) {
-        if (terminal.resized) {
-            qe_winsize();
-        }
-
-        // TODO: Move to bottom of screen and perform.
-        // if (editor.dirty_status) {
-        //     qe_draw_status();
-        // }
-
-        if (editor.dirty_cursor) {
-            qe_draw_cursor();
-            fflush(stdout);
-        }
+    qe_loop_add(STDIN_FILENO, qe_input_ready);
+    if (!editor.read_only) {
+        atexit(qe_edit_sync);
+    }
+    qe_line_index_progress();
+    if (editor.follow) {
+        qe_follow_init();
+    }
 
+    while (1) {
         if (editor.dirty) {
             qe_draw();
+        } else if (editor.dirty_cursor) {
+            qe_draw_cursor();
+            qe_frame_flush();
         }
 
-        int c = qe_readkey();
-
-        // if the mode changes, update the buffer
-        enum edit_mode mode = editor.mode;
-        qe_process_key(c);
-        // TODO: Change how we update the buffer
-        if (mode != editor.mode && editor.mode != MODE_SEARCH) {
-            qe_update_status_buffer();
-            editor.dirty = 1;
-        }
+        qe_loop_wait();
     }
 }